@@ -0,0 +1,274 @@
+#include "Auth.hpp"
+#include "Channel.hpp"
+#include "Hash.hpp"
+#include "Recorder.hpp"
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <pthread.h>
+#include <unistd.h>
+
+enum AuthKind {
+    AUTH_PASS,
+    AUTH_OPER
+};
+
+struct AuthJob {
+    int fd;
+    unsigned long ticket;
+    AuthKind kind;
+    std::string password;
+    std::string credential;
+    bool knownName;         // false runs the hash anyway so unknown opers take as long
+    uint64_t submitTime;
+};
+
+struct AuthResult {
+    int fd;
+    unsigned long ticket;
+    AuthKind kind;
+    bool accepted;
+    uint64_t waitTime;
+    uint64_t hashTime;
+};
+
+struct AuthStats {
+    unsigned long accepted;
+    unsigned long rejected;
+    unsigned long refused;
+    uint64_t totalWait;
+    uint64_t maxWait;
+    uint64_t totalHash;
+    uint64_t windowStart;
+    unsigned long windowCompleted;
+    double rate;
+
+    AuthStats() : accepted(0), rejected(0), refused(0), totalWait(0), maxWait(0), totalHash(0),
+                  windowStart(0), windowCompleted(0), rate(0) {}
+};
+
+static std::string serverCredential;
+static std::map<std::string, std::string> operCredentials;
+
+static pthread_mutex_t jobMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobCond = PTHREAD_COND_INITIALIZER;
+static std::deque<AuthJob> jobs;
+
+static pthread_mutex_t resultMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::deque<AuthResult> results;
+static int wakePipe[2] = { -1, -1 };
+
+static unsigned long nextTicket = 0;
+static unsigned long inFlight = 0;
+static AuthStats stats;
+
+static void *workerMain(void *) {
+    while (true) {
+        pthread_mutex_lock(&jobMutex);
+        while (jobs.empty())
+            pthread_cond_wait(&jobCond, &jobMutex);
+        AuthJob job = jobs.front();
+        jobs.pop_front();
+        pthread_mutex_unlock(&jobMutex);
+
+        AuthResult result;
+        result.fd = job.fd;
+        result.ticket = job.ticket;
+        result.kind = job.kind;
+        uint64_t start = traceClock();
+        result.accepted = verifyCredential(job.password, job.credential) && job.knownName;
+        result.hashTime = traceClock() - start;
+        result.waitTime = start - job.submitTime;
+
+        pthread_mutex_lock(&resultMutex);
+        results.push_back(result);
+        pthread_mutex_unlock(&resultMutex);
+        char wake = 0;
+        if (write(wakePipe[1], &wake, 1) < 0) {
+            // Pipe already full: the reactor is woken up anyway
+        }
+    }
+    return NULL;
+}
+
+static void loadOperators() {
+    std::ifstream in(OPER_FILE);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream iss(line);
+        std::string name, credential;
+        if (!(iss >> name >> credential) || name[0] == '#')
+            continue;
+        if (!isCredential(credential)) {
+            std::cerr << OPER_FILE << ": ignoring " << name << ", not a " << CREDENTIAL_PREFIX << " credential" << std::endl;
+            continue;
+        }
+        operCredentials[name] = credential;
+    }
+}
+
+// A plaintext server password is hashed here so it is never kept in memory
+bool authInit(const std::string& serverPassword) {
+    serverCredential = isCredential(serverPassword) ? serverPassword
+                                                    : makeCredential(serverPassword, PBKDF2_DEFAULT_ITERATIONS);
+    if (serverCredential.empty()) {
+        std::cerr << "Error hashing server password" << std::endl;
+        return false;
+    }
+    loadOperators();
+
+    if (pipe(wakePipe) < 0) {
+        std::cerr << "Error creating auth pipe" << std::endl;
+        return false;
+    }
+    fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+
+    sigset_t saved;
+    traceBlockDumpSignal(saved);
+    for (int i = 0; i < AUTH_WORKER_COUNT; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, workerMain, NULL) != 0) {
+            std::cerr << "Error starting auth worker" << std::endl;
+            pthread_sigmask(SIG_SETMASK, &saved, NULL);
+            return false;
+        }
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return true;
+}
+
+int authWakeFd() {
+    return wakePipe[0];
+}
+
+static bool submit(int clientSockfd, AuthKind kind, const std::string& password, const std::string& credential, bool knownName) {
+    if (inFlight >= AUTH_MAX_QUEUE) {
+        stats.refused++;
+        return false;
+    }
+
+    AuthJob job;
+    job.fd = clientSockfd;
+    job.ticket = ++nextTicket;
+    job.kind = kind;
+    job.password = password;
+    job.credential = credential;
+    job.knownName = knownName;
+    job.submitTime = traceClock();
+
+    clients[clientSockfd].authPending = true;
+    clients[clientSockfd].authTicket = job.ticket;
+    inFlight++;
+
+    pthread_mutex_lock(&jobMutex);
+    jobs.push_back(job);
+    pthread_cond_signal(&jobCond);
+    pthread_mutex_unlock(&jobMutex);
+    return true;
+}
+
+// Returns false when the queue is full and the client should retry later
+bool authSubmitPass(int clientSockfd, const std::string& password) {
+    return submit(clientSockfd, AUTH_PASS, password, serverCredential, true);
+}
+
+bool authSubmitOper(int clientSockfd, const std::string& name, const std::string& password) {
+    std::map<std::string, std::string>::const_iterator it = operCredentials.find(name);
+    if (it == operCredentials.end())
+        return submit(clientSockfd, AUTH_OPER, password, serverCredential, false);
+    return submit(clientSockfd, AUTH_OPER, password, it->second, true);
+}
+
+static void rollWindow(uint64_t now) {
+    if (stats.windowStart == 0) {
+        stats.windowStart = now;
+    } else if (now - stats.windowStart >= 1000000000ULL) {
+        stats.rate = stats.windowCompleted * 1e9 / (now - stats.windowStart);
+        stats.windowStart = now;
+        stats.windowCompleted = 0;
+    }
+}
+
+// Applies finished checks; fds in resumed have parked lines to process
+void authCollect(std::vector<int>& resumed) {
+    char drain[256];
+    while (read(wakePipe[0], drain, sizeof(drain)) > 0) {
+    }
+
+    std::deque<AuthResult> done;
+    pthread_mutex_lock(&resultMutex);
+    done.swap(results);
+    pthread_mutex_unlock(&resultMutex);
+
+    rollWindow(traceClock());
+    for (std::deque<AuthResult>::iterator it = done.begin(); it != done.end(); ++it) {
+        inFlight--;
+        stats.windowCompleted++;
+        stats.totalWait += it->waitTime;
+        stats.totalHash += it->hashTime;
+        if (it->waitTime > stats.maxWait)
+            stats.maxWait = it->waitTime;
+        if (it->accepted)
+            stats.accepted++;
+        else
+            stats.rejected++;
+
+        // The client may have left, and its fd been reused, while the check ran
+        std::map<int, Client>::iterator client = clients.find(it->fd);
+        if (client == clients.end() || !client->second.authPending || client->second.authTicket != it->ticket)
+            continue;
+        client->second.authPending = false;
+
+        if (it->kind == AUTH_PASS) {
+            if (it->accepted) {
+                client->second.passwordVerified = true;
+                sendMessage(it->fd, "Authentication successful.\r\n");
+            } else {
+                sendMessage(it->fd, "464 :Password incorrect\r\n");
+            }
+        } else if (it->accepted) {
+            operators.insert(it->fd);
+            sendMessage(it->fd, ":localhost 381 " + client->second.nickname + " :You are now an IRC operator\r\n");
+        } else {
+            sendMessage(it->fd, ":localhost 464 " + client->second.nickname + " :Password incorrect\r\n");
+        }
+        resumed.push_back(it->fd);
+    }
+}
+
+// Checks waiting for a worker or for the reactor, for STATS z
+size_t authQueueBytes() {
+    pthread_mutex_lock(&jobMutex);
+    size_t total = jobs.size() * sizeof(AuthJob);
+    for (std::deque<AuthJob>::const_iterator it = jobs.begin(); it != jobs.end(); ++it)
+        total += it->password.capacity() + it->credential.capacity();
+    pthread_mutex_unlock(&jobMutex);
+
+    pthread_mutex_lock(&resultMutex);
+    total += results.size() * sizeof(AuthResult);
+    pthread_mutex_unlock(&resultMutex);
+    return total;
+}
+
+void sendAuthStats(int clientSockfd) {
+    rollWindow(traceClock());
+
+    pthread_mutex_lock(&jobMutex);
+    size_t queued = jobs.size();
+    pthread_mutex_unlock(&jobMutex);
+
+    unsigned long completed = stats.accepted + stats.rejected;
+    const std::string prefix = ":localhost 249 " + clients[clientSockfd].nickname + " a :";
+    std::ostringstream oss;
+    oss << prefix << "Workers " << AUTH_WORKER_COUNT << ", queued " << queued << ", in flight " << inFlight << "\r\n"
+        << prefix << "Checks " << stats.accepted << " accepted, " << stats.rejected << " rejected, "
+        << stats.refused << " refused (queue full)\r\n"
+        << prefix << "Throughput " << stats.rate << " checks/s\r\n"
+        << prefix << "Queue wait avg " << (completed ? stats.totalWait / completed / 1000 : 0)
+        << " us, max " << stats.maxWait / 1000 << " us\r\n"
+        << prefix << "Hash time avg " << (completed ? stats.totalHash / completed / 1000 : 0) << " us\r\n"
+        << ":localhost 219 " << clients[clientSockfd].nickname << " a :End of STATS report\r\n";
+    sendMessage(clientSockfd, oss.str());
+}
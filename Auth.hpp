@@ -0,0 +1,24 @@
+#ifndef AUTH_HPP
+#define AUTH_HPP
+
+#include <string>
+#include <vector>
+
+// PASS and OPER checks run PBKDF2, which is deliberately slow, so they are
+// handed to a small pool of worker threads. The client is parked with
+// authPending set and reads nothing more until the result comes back
+// through the completion queue, whose pipe wakes up poll().
+
+#define AUTH_WORKER_COUNT 4
+#define AUTH_MAX_QUEUE 1024         // checks waiting for a worker before PASS/OPER get 263
+#define OPER_FILE "ircserv.opers"   // "<name> <credential>" per line
+
+bool authInit(const std::string& serverPassword);
+int authWakeFd();
+bool authSubmitPass(int clientSockfd, const std::string& password);
+bool authSubmitOper(int clientSockfd, const std::string& name, const std::string& password);
+void authCollect(std::vector<int>& resumed);
+void sendAuthStats(int clientSockfd);
+size_t authQueueBytes();
+
+#endif // AUTH_HPP
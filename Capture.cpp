@@ -0,0 +1,237 @@
+#include "Capture.hpp"
+#include "LowLatency.hpp"
+#include "Memory.hpp"
+#include "Recorder.hpp"
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <pthread.h>
+#include <sstream>
+#include <unistd.h>
+
+struct CapturedConnection {
+    uint32_t id;
+};
+
+// Full buffers go to the writer thread; the last one of a capture closes its file
+struct CaptureJob {
+    int fd;
+    bool last;
+    std::string data;
+};
+
+static bool writerStarted = false;
+static pthread_mutex_t queueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+static std::deque<CaptureJob> writeQueue;
+static size_t queuedBytes = 0;
+
+static int outFd = -1;
+static std::string path;
+static std::string pending;
+static uint64_t lastTime = 0;
+static unsigned long recordCount = 0;
+static uint32_t nextConnectionId = 0;
+static std::map<int, CapturedConnection> connections;
+
+static void putVarint(std::string& buffer, uint64_t value) {
+    while (value >= 0x80) {
+        buffer += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    buffer += static_cast<char>(value);
+}
+
+static void writeAll(int fd, const std::string& data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t written = write(fd, data.data() + offset, data.size() - offset);
+        if (written <= 0) {
+            std::cerr << "Capture write failed" << std::endl;
+            return;
+        }
+        offset += written;
+    }
+}
+
+static void *writerMain(void *) {
+    lowLatencyReleaseThread();
+    while (true) {
+        std::deque<CaptureJob> jobs;
+        pthread_mutex_lock(&queueMutex);
+        while (writeQueue.empty())
+            pthread_cond_wait(&queueCond, &queueMutex);
+        jobs.swap(writeQueue);
+        pthread_mutex_unlock(&queueMutex);
+
+        for (std::deque<CaptureJob>::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+            writeAll(it->fd, it->data);
+            if (it->last)
+                close(it->fd);
+            pthread_mutex_lock(&queueMutex);
+            queuedBytes -= it->data.size();
+            pthread_mutex_unlock(&queueMutex);
+        }
+    }
+    return NULL;
+}
+
+static bool startWriter() {
+    if (writerStarted)
+        return true;
+    sigset_t saved;
+    traceBlockDumpSignal(saved);
+    pthread_t thread;
+    writerStarted = (pthread_create(&thread, NULL, writerMain, NULL) == 0);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (writerStarted)
+        pthread_detach(thread);
+    return writerStarted;
+}
+
+// Hands the buffered records to the writer thread, so the loop never waits on the disk
+static void flush(bool last) {
+    CaptureJob job;
+    job.fd = outFd;
+    job.last = last;
+    pthread_mutex_lock(&queueMutex);
+    writeQueue.push_back(job);
+    writeQueue.back().data.swap(pending);
+    queuedBytes += writeQueue.back().data.size();
+    pthread_cond_signal(&queueCond);
+    pthread_mutex_unlock(&queueMutex);
+    pending.reserve(CAPTURE_FLUSH_BYTES);
+}
+
+static void writeRecord(CaptureRecord type, uint32_t connectionId, const std::string *line) {
+    uint64_t now = traceClock();
+    pending += static_cast<char>(type);
+    putVarint(pending, now - lastTime);
+    putVarint(pending, connectionId);
+    if (line) {
+        putVarint(pending, line->length());
+        pending += *line;
+    }
+    lastTime = now;
+    recordCount++;
+    if (pending.size() >= CAPTURE_FLUSH_BYTES)
+        flush(false);
+}
+
+// Connections that were already open when the capture started show up
+// with their next line
+static CapturedConnection& connectionFor(int clientSockfd) {
+    std::map<int, CapturedConnection>::iterator it = connections.find(clientSockfd);
+    if (it != connections.end())
+        return it->second;
+
+    CapturedConnection& connection = connections[clientSockfd];
+    connection.id = nextConnectionId++;
+    writeRecord(CAPTURE_CONNECT, connection.id, NULL);
+    return connection;
+}
+
+// Before registration any line whose first four bytes are PASS is a PASS,
+// whatever follows; case is ignored here so no spelling the server might
+// accept is missed
+static bool startsWithCommand(const std::string& line, const char *command) {
+    for (size_t i = 0; i < 4; ++i) {
+        if (i >= line.length() || std::toupper(static_cast<unsigned char>(line[i])) != command[i])
+            return false;
+    }
+    return true;
+}
+
+// PASS and OPER keep their command and separator; the password, i.e.
+// everything from the sixth byte, is replaced. OPER keeps its name only
+// when it is space separated the way the dispatcher splits it.
+static std::string redact(const std::string& line) {
+    if (line.length() <= 5)
+        return line;
+    if (startsWithCommand(line, "PASS"))
+        return line.substr(0, 5) + CAPTURE_REDACTED;
+    if (startsWithCommand(line, "OPER")) {
+        size_t nameStart = line[4] == ' ' ? line.find_first_not_of(' ', 5) : std::string::npos;
+        size_t nameEnd = nameStart == std::string::npos ? std::string::npos : line.find(' ', nameStart);
+        return line.substr(0, nameEnd == std::string::npos ? 5 : nameEnd + 1) + CAPTURE_REDACTED;
+    }
+    return line;
+}
+
+// Returns the file name, or "" if it could not be created
+std::string captureStart() {
+    if (captureActive())
+        return path;
+
+    std::ostringstream name;
+    name << "ircserv-capture-" << getpid() << "-" << time(NULL) << ".bin";
+    if (!startWriter())
+        return "";
+    outFd = open(name.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outFd < 0)
+        return "";
+
+    CaptureHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    pending.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    path = name.str();
+    lastTime = traceClock();
+    recordCount = 0;
+    nextConnectionId = 0;
+    connections.clear();
+    return path;
+}
+
+std::string captureStop(unsigned long& records) {
+    records = recordCount;
+    if (!captureActive())
+        return "";
+    flush(true);
+    outFd = -1;
+    connections.clear();
+    std::string finished;
+    finished.swap(path);
+    return finished;
+}
+
+bool captureActive() {
+    return !path.empty();
+}
+
+void captureConnect(int clientSockfd) {
+    if (captureActive())
+        connectionFor(clientSockfd);
+}
+
+void captureLine(int clientSockfd, const char *line, size_t length) {
+    if (!captureActive())
+        return;
+
+    uint32_t connectionId = connectionFor(clientSockfd).id;
+    std::string redacted = redact(std::string(line, length));
+    writeRecord(CAPTURE_LINE, connectionId, &redacted);
+}
+
+// Records not yet on disk and the connection map, for STATS z
+size_t captureBytes() {
+    pthread_mutex_lock(&queueMutex);
+    size_t queued = queuedBytes;
+    pthread_mutex_unlock(&queueMutex);
+    return pending.capacity() + queued
+         + connections.size() * (TREE_NODE_BYTES + sizeof(std::pair<const int, CapturedConnection>));
+}
+
+void captureClose(int clientSockfd) {
+    std::map<int, CapturedConnection>::iterator it = connections.find(clientSockfd);
+    if (it == connections.end())
+        return;
+    writeRecord(CAPTURE_CLOSE, it->second.id, NULL);
+    connections.erase(it);
+}
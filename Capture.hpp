@@ -0,0 +1,44 @@
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+// Traffic capture for tools/replay. While CAPTURE START is in effect every
+// inbound line is appended to ircserv-capture-<pid>-<time>.bin together
+// with the connection it came from and when it was handled. Lines are
+// recorded as the scanner hands them to dispatch, so redaction sees the
+// same text the server does: passwords of PASS and OPER are replaced by
+// CAPTURE_REDACTED before they are written. Records are buffered and
+// every CAPTURE_FLUSH_BYTES handed to a writer thread.
+
+#define CAPTURE_MAGIC "IRCCAPT1"
+#define CAPTURE_VERSION 1
+#define CAPTURE_REDACTED "*"
+#define CAPTURE_FLUSH_BYTES (64 * 1024)
+
+// Each record is a type byte followed by LEB128 varints: nanoseconds since
+// the previous record, the connection id and, for CAPTURE_LINE, the line
+// length and its bytes without the line ending and surrounding spaces.
+enum CaptureRecord {
+    CAPTURE_CONNECT = 1,
+    CAPTURE_LINE = 2,
+    CAPTURE_CLOSE = 3
+};
+
+struct CaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+std::string captureStart();
+std::string captureStop(unsigned long& records);
+bool captureActive();
+void captureConnect(int clientSockfd);
+void captureLine(int clientSockfd, const char *line, size_t length);
+void captureClose(int clientSockfd);
+size_t captureBytes();
+
+#endif // CAPTURE_HPP
@@ -1,15 +1,73 @@
 #include "Channel.hpp"
+#include "Commands.hpp"
+#include "Memory.hpp"
+#include "Query.hpp"
+#include "Recorder.hpp"
+#include "Registry.hpp"
+#include <cerrno>
 #include <cstring>
 #include <sstream>
 #include <algorithm>
 #include <sys/socket.h>
 
 std::map<int, Client> clients;
-std::map<std::string, Channel> channels;
+ChannelTable channels;
 std::set<int> operators;
 
+// Writes what the socket accepts right away and queues the rest for POLLOUT.
 void sendMessage(int clientSockfd, const std::string& message) {
-    send(clientSockfd, message.c_str(), message.length(), 0);
+    std::map<int, Client>::iterator it = clients.find(clientSockfd);
+    if (it == clients.end()) {
+        send(clientSockfd, message.c_str(), message.length(), MSG_NOSIGNAL);
+        return;
+    }
+
+    Client& client = it->second;
+    if (!client.quitReason.empty())
+        return;
+
+    size_t offset = 0;
+    if (client.outBuffer.empty()) {
+        ssize_t sent = send(clientSockfd, message.c_str(), message.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            client.quitReason = "Write error";
+            return;
+        }
+        offset = sent < 0 ? 0 : static_cast<size_t>(sent);
+        if (traceActive())
+            traceMark(TRACE_FLUSH);
+        if (offset == message.length())
+            return;
+    }
+    if (traceActive())
+        traceQueued();
+
+    if (client.outBuffer.size() + message.length() - offset > MAX_SENDQ) {
+        client.outBuffer.clear();
+        client.quitReason = "SendQ exceeded";
+        return;
+    }
+    client.outBuffer.append(message, offset, std::string::npos);
+}
+
+void flushClient(int clientSockfd) {
+    std::map<int, Client>::iterator it = clients.find(clientSockfd);
+    if (it == clients.end() || it->second.outBuffer.empty())
+        return;
+
+    Client& client = it->second;
+    ssize_t sent = send(clientSockfd, client.outBuffer.c_str(), client.outBuffer.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            client.quitReason = "Write error";
+        return;
+    }
+    client.outBuffer.erase(0, sent);
+#ifndef IRC_LOW_LATENCY
+    // Low-latency builds keep the capacity reserved on accept instead
+    if (client.outBuffer.empty())
+        std::string().swap(client.outBuffer);
+#endif
 }
 
 std::string intToString(int value) {
@@ -19,11 +77,14 @@ std::string intToString(int value) {
 }
 
 void broadcastToChannel(Channel& channel, const std::string& message, int excludeSockfd) {
+    traceMark(TRACE_FANOUT_START);
     for (std::vector<int>::iterator it = channel.clients.begin(); it != channel.clients.end(); ++it) {
         if (*it != excludeSockfd) {
             sendMessage(*it, message);
         }
     }
+    traceFanout(channel.clients.size());
+    traceMark(TRACE_FANOUT_END);
 }
 
 void sendMessageRFC(int clientSockfd, const std::string &prefix, const std::string &command, const std::string &params, const std::string &trailing) {
@@ -33,44 +94,44 @@ void sendMessageRFC(int clientSockfd, const std::string &prefix, const std::stri
     if (!params.empty()) oss << " " << params;
     if (!trailing.empty()) oss << " :" << trailing;
     oss << "\r\n";
-    send(clientSockfd, oss.str().c_str(), oss.str().length(), 0);
+    sendMessage(clientSockfd, oss.str());
 }
 
 void handleKick(int clientSockfd, const std::string& channelName, const std::string& targetNick) {
-    if (!doesChannelExist(channelName)) {
+    ChannelId channelId = channels.find(channelName);
+    if (channelId == NO_CHANNEL) {
         // Send error: No such channel (Numeric 403)
         sendMessage(clientSockfd, ":localhost 403 " + clients[clientSockfd].nickname + " " + channelName + " :No such channel\r\n");
         return;
     }
 
-    if (!isChannelOperator(clientSockfd, channelName)) {
+    if (!isChannelOperator(clientSockfd, channelId)) {
         // Send error: You're not channel operator (Numeric 482)
         sendMessage(clientSockfd, ":localhost 482 " + clients[clientSockfd].nickname + " " + channelName + " :You're not a channel operator\r\n");
         return;
     }
 
     int targetClientSockfd = findClientByNick(targetNick);
-    if (targetClientSockfd == -1 || !isClientInChannel(targetClientSockfd, channelName)) {
+    if (targetClientSockfd == -1 || !isClientInChannel(targetClientSockfd, channelId)) {
         // Send error: User not in channel (Numeric 441)
         sendMessage(clientSockfd, ":localhost 441 " + clients[clientSockfd].nickname + " " + targetNick + " " + channelName + " :They are not on that channel\r\n");
         return;
     }
 
-    Channel& channel = channels[channelName];
-
-    // Remove the client from the channel
-    channel.clients.erase(std::remove(channel.clients.begin(), channel.clients.end(), targetClientSockfd), channel.clients.end());
-
-    // Remove the channel from the user's list
-    clients[targetClientSockfd].channels.erase(std::remove(clients[targetClientSockfd].channels.begin(), clients[targetClientSockfd].channels.end(), channelName), clients[targetClientSockfd].channels.end());
+    Channel& channel = channels[channelId];
 
     // Notify all users in the channel about the kick
     std::ostringstream kickMessage;
     kickMessage << ":" << clients[clientSockfd].nickname << "!~" << clients[clientSockfd].username 
                 << "@" << clients[clientSockfd].hostname 
-                << " KICK " << channelName << " " << targetNick << " :Kicked by operator\r\n";
+                << " KICK " << channel.name << " " << targetNick << " :Kicked by operator\r\n";
 
-    broadcastToChannel(channel, kickMessage.str(), -1);
+    // Remove the client from the channel (and the channel from the user's list)
+    leaveChannel(targetClientSockfd, channelId);
+
+    if (channels.isActive(channelId)) {
+        broadcastToChannel(channel, kickMessage.str(), -1);
+    }
 
     // Notify the kicked user
     sendMessage(targetClientSockfd, kickMessage.str());
@@ -78,32 +139,33 @@ void handleKick(int clientSockfd, const std::string& channelName, const std::str
 
 
 void handleTopic(int clientSockfd, const std::string& channelName, const std::string& newTopic) {
-    std::map<std::string, Channel>::iterator it = channels.find(channelName);
+    ChannelId channelId = channels.find(channelName);
 
-    if (it == channels.end()) {
+    if (channelId == NO_CHANNEL) {
         // Send error: No such channel (Numeric 403)
         sendMessage(clientSockfd, ":localhost 403 " + clients[clientSockfd].nickname + " " + channelName + " :No such channel\r\n");
         return;
     }
 
-    Channel& channel = it->second;
+    Channel& channel = channels[channelId];
 
     if (!newTopic.empty()) {
         // Check if the user is allowed to set the topic
-        if (channel.topicRestricted && !isChannelOperator(clientSockfd, channelName)) {
+        if (channel.topicRestricted && !isChannelOperator(clientSockfd, channelId)) {
             // Send error: No permission to change the topic (Numeric 482)
             sendMessage(clientSockfd, ":localhost 482 " + clients[clientSockfd].nickname + " " + channelName + " :You do not have permission to change the topic\r\n");
             return;
         }
 
         // Set the new topic
-        channel.topic = newTopic;
+        channel.topic = newTopic.substr(0, MAX_TOPIC_LENGTH);
+        registryUpdate(channelId);
 
         // Notify all clients in the channel about the new topic
         std::ostringstream topicMessage;
         topicMessage << ":" << clients[clientSockfd].nickname << "!~" << clients[clientSockfd].username 
                      << "@" << clients[clientSockfd].hostname 
-                     << " TOPIC " << channelName << " :" << newTopic << "\r\n";
+                     << " TOPIC " << channelName << " :" << channel.topic << "\r\n";
 
         broadcastToChannel(channel, topicMessage.str(), -1);
     } else {
@@ -118,23 +180,75 @@ void handleTopic(int clientSockfd, const std::string& channelName, const std::st
     }
 }
 
+static MaskList* listForMode(Channel& channel, char mode) {
+    if (mode == 'b')
+        return &channel.bans;
+    if (mode == 'e')
+        return &channel.exceptions;
+    if (mode == 'I')
+        return &channel.inviteExceptions;
+    return NULL;
+}
+
+// MODE #chan b|e|I lists entries (367/368, 348/349, 346/347)
+static void sendMaskList(int clientSockfd, const Channel& channel, char mode, const MaskList& list) {
+    const char *entry = mode == 'b' ? "367" : mode == 'e' ? "348" : "346";
+    const char *end = mode == 'b' ? "368" : mode == 'e' ? "349" : "347";
+    const char *what = mode == 'b' ? "ban" : mode == 'e' ? "exception" : "invite";
+
+    const std::string& nick = clients[clientSockfd].nickname;
+    for (std::vector<std::string>::const_iterator it = list.entries().begin(); it != list.entries().end(); ++it) {
+        sendMessage(clientSockfd, ":localhost " + std::string(entry) + " " + nick + " " + channel.name + " " + *it + "\r\n");
+    }
+    sendMessage(clientSockfd, ":localhost " + std::string(end) + " " + nick + " " + channel.name + " :End of channel " + what + " list\r\n");
+}
+
 void handleMode(int clientSockfd, const std::string& channelName, const std::string& mode, const std::string& param) {
-    if (!isChannelOperator(clientSockfd, channelName)) {
-        sendMessage(clientSockfd, ":localhost 482 " + clients[clientSockfd].nickname + " " + channelName + " :You are not a channel operator.\r\n");
+    ChannelId channelId = channels.find(channelName);
+
+    // List modes: viewing is open to everyone, changing requires operator
+    char listMode = mode.empty() ? 0 : mode[mode.length() - 1];
+    bool isListMode = (mode.length() == 1 || (mode.length() == 2 && (mode[0] == '+' || mode[0] == '-')))
+                      && (listMode == 'b' || listMode == 'e' || listMode == 'I');
+    if (isListMode && param.empty() && channelId != NO_CHANNEL) {
+        sendMaskList(clientSockfd, channels[channelId], listMode, *listForMode(channels[channelId], listMode));
         return;
     }
 
-    std::map<std::string, Channel>::iterator channelIt = channels.find(channelName);
-    if (channelIt == channels.end()) {
-        sendMessage(clientSockfd, ":localhost 403 " + clients[clientSockfd].nickname + " " + channelName + " :No such channel\r\n");
+    // +P/-P registers a channel as persistent, which only server operators may do
+    if ((mode == "+P" || mode == "-P") && channelId != NO_CHANNEL) {
+        if (!isOperator(clientSockfd)) {
+            sendMessage(clientSockfd, ":localhost 481 " + clients[clientSockfd].nickname + " :Permission Denied- You're not an IRC operator\r\n");
+            return;
+        }
+        Channel& channel = channels[channelId];
+        channel.persistent = (mode == "+P");
+        if (channel.persistent)
+            registryUpdate(channelId);
+        else
+            registryRemove(channel.name);
+
+        broadcastToChannel(channel, ":localhost MODE " + channelName + " " + mode + "\r\n", -1);
+        if (!isClientInChannel(clientSockfd, channelId))
+            sendMessage(clientSockfd, ":localhost MODE " + channelName + " " + mode + "\r\n");
+        if (!channel.persistent && channel.clients.empty()) {
+            updateChannelIndex(channelId, 0);
+            eraseChannel(channelId);
+        }
+        return;
+    }
+
+    if (!isChannelOperator(clientSockfd, channelId)) {
+        sendMessage(clientSockfd, ":localhost 482 " + clients[clientSockfd].nickname + " " + channelName + " :You are not a channel operator.\r\n");
         return;
     }
 
-    Channel& channel = channelIt->second;
+    Channel& channel = channels[channelId];
 
     if (mode == "-i") {
         // Toggle invite-only mode
         channel.inviteOnly = !channel.inviteOnly;
+        registryUpdate(channelId);
         std::string status = channel.inviteOnly ? "+i" : "-i";
 
         std::string modeMessage = ":localhost MODE " + channelName + " " + status + "\r\n";
@@ -142,6 +256,7 @@ void handleMode(int clientSockfd, const std::string& channelName, const std::str
     } else if (mode == "-t") {
         // Toggle topic restriction
         channel.topicRestricted = !channel.topicRestricted;
+        registryUpdate(channelId);
         std::string status = channel.topicRestricted ? "+t" : "-t";
 
         std::string modeMessage = ":localhost MODE " + channelName + " " + status + "\r\n";
@@ -150,10 +265,14 @@ void handleMode(int clientSockfd, const std::string& channelName, const std::str
         // Set or remove the channel key (password)
         if (param.empty()) {
             channel.key.clear();
+            registryUpdate(channelId);
             std::string modeMessage = ":localhost MODE " + channelName + " -k\r\n";
             broadcastToChannel(channel, modeMessage, -1);
+        } else if (param.length() > MAX_KEY_LENGTH) {
+            sendMessage(clientSockfd, ":localhost 525 " + clients[clientSockfd].nickname + " " + channelName + " :Key is not well-formed\r\n");
         } else {
             channel.key = param;
+            registryUpdate(channelId);
             std::string modeMessage = ":localhost MODE " + channelName + " +k " + param + "\r\n";
             broadcastToChannel(channel, modeMessage, -1);
         }
@@ -166,6 +285,7 @@ void handleMode(int clientSockfd, const std::string& channelName, const std::str
             return;
         }
         channel.userLimit = userLimit;
+        registryUpdate(channelId);
 
         std::string modeMessage = ":localhost MODE " + channelName + " +l " + param + "\r\n";
         broadcastToChannel(channel, modeMessage, -1);
@@ -177,7 +297,7 @@ void handleMode(int clientSockfd, const std::string& channelName, const std::str
             return;
         }
 
-        if (isChannelOperator(targetClientSockfd, channelName)) {
+        if (isChannelOperator(targetClientSockfd, channelId)) {
             // Remove operator
             channel.operators.erase(std::remove(channel.operators.begin(), channel.operators.end(), targetClientSockfd), channel.operators.end());
             std::string modeMessage = ":localhost MODE " + channelName + " -o " + clients[targetClientSockfd].nickname + "\r\n";
@@ -188,6 +308,23 @@ void handleMode(int clientSockfd, const std::string& channelName, const std::str
             std::string modeMessage = ":localhost MODE " + channelName + " +o " + clients[targetClientSockfd].nickname + "\r\n";
             broadcastToChannel(channel, modeMessage, -1);
         }
+    } else if (isListMode) {
+        // Add or remove a ban (+b), ban exception (+e) or invite exception (+I) mask
+        MaskList& list = *listForMode(channel, listMode);
+        std::string mask = normalizeHostmask(param);
+        bool adding = mode[0] != '-';
+
+        if (adding && list.size() >= MAX_LIST_ENTRIES) {
+            sendMessage(clientSockfd, ":localhost 478 " + clients[clientSockfd].nickname + " " + channelName + " " + mask + " :Channel list is full\r\n");
+            return;
+        }
+        if (adding ? !list.add(mask) : !list.remove(mask))
+            return;
+        if (listMode != 'I')
+            channel.listGeneration++;
+
+        std::string modeMessage = ":localhost MODE " + channelName + " " + (adding ? "+" : "-") + listMode + " " + mask + "\r\n";
+        broadcastToChannel(channel, modeMessage, -1);
     } else {
         sendMessage(clientSockfd, ":localhost 472 " + mode + " :is unknown mode char to me\r\n");
     }
@@ -195,22 +332,109 @@ void handleMode(int clientSockfd, const std::string& channelName, const std::str
 
 
 
-bool isChannelOperator(int clientSockfd, const std::string& channelName) {
-    std::map<std::string, Channel>::iterator it = channels.find(channelName);
-    if (it != channels.end()) {
-        return std::find(it->second.operators.begin(), it->second.operators.end(), clientSockfd) != it->second.operators.end();
+bool isChannelOperator(int clientSockfd, ChannelId channelId) {
+    if (channelId != NO_CHANNEL) {
+        const Channel& channel = channels[channelId];
+        return std::find(channel.operators.begin(), channel.operators.end(), clientSockfd) != channel.operators.end();
     }
     return false;
 }
 
-bool isClientInChannel(int clientSockfd, const std::string& channelName) {
-    std::map<std::string, Channel>::iterator it = channels.find(channelName);
-    if (it != channels.end()) {
-        return std::find(it->second.clients.begin(), it->second.clients.end(), clientSockfd) != it->second.clients.end();
+bool isClientInChannel(int clientSockfd, ChannelId channelId) {
+    if (channelId != NO_CHANNEL) {
+        const Channel& channel = channels[channelId];
+        return std::find(channel.clients.begin(), channel.clients.end(), clientSockfd) != channel.clients.end();
     }
     return false;
 }
 
-bool doesChannelExist(const std::string& channelName) {
-    return channels.find(channelName) != channels.end();
+static std::string clientHostmask(int clientSockfd) {
+    const Client& client = clients[clientSockfd];
+    return ircCasefold(client.nickname + "!" + client.username + "@" + client.hostname);
+}
+
+static unsigned long maskGenerationCounter = 0;
+
+// Invalidates every cached ban verdict for this client
+void touchClientMask(int clientSockfd) {
+    clients[clientSockfd].maskGeneration = ++maskGenerationCounter;
+}
+
+// Matches +b unless +e also matches; cached per (client, channel)
+bool isBanned(int clientSockfd, ChannelId channelId) {
+    Channel& channel = channels[channelId];
+    if (channel.bans.size() == 0)
+        return false;
+
+    unsigned long clientGeneration = clients[clientSockfd].maskGeneration;
+    std::map<int, BanCacheEntry>::iterator it = channel.banCache.find(clientSockfd);
+    if (it != channel.banCache.end() && it->second.clientGeneration == clientGeneration
+        && it->second.listGeneration == channel.listGeneration) {
+        return it->second.banned;
+    }
+
+    std::string hostmask = clientHostmask(clientSockfd);
+    BanCacheEntry entry;
+    entry.clientGeneration = clientGeneration;
+    entry.listGeneration = channel.listGeneration;
+    entry.banned = channel.bans.matches(hostmask) && !channel.exceptions.matches(hostmask);
+    if (it == channel.banCache.end()) {
+        channel.banCache[clientSockfd] = entry;
+        // The id may already be listed if a channel erased earlier reused it
+        std::vector<ChannelId>& cached = clients[clientSockfd].banCachedIn;
+        if (std::find(cached.begin(), cached.end(), channelId) == cached.end())
+            cached.push_back(channelId);
+    } else {
+        it->second = entry;
+    }
+    return entry.banned;
+}
+
+bool isInviteExempt(int clientSockfd, ChannelId channelId) {
+    return channels[channelId].inviteExceptions.matches(clientHostmask(clientSockfd));
+}
+
+// Drops the membership on both sides and erases the channel once it is
+// empty, unless it is registered as persistent
+void leaveChannel(int clientSockfd, ChannelId channelId) {
+    Channel& channel = channels[channelId];
+    size_t oldMemberCount = channel.clients.size();
+    channel.clients.erase(std::remove(channel.clients.begin(), channel.clients.end(), clientSockfd), channel.clients.end());
+    updateChannelIndex(channelId, oldMemberCount);
+    channel.operators.erase(std::remove(channel.operators.begin(), channel.operators.end(), clientSockfd), channel.operators.end());
+
+    channel.banCache.erase(clientSockfd);
+
+    std::map<int, Client>::iterator it = clients.find(clientSockfd);
+    if (it != clients.end()) {
+        std::vector<ChannelId>& joined = it->second.channels;
+        joined.erase(std::remove(joined.begin(), joined.end(), channelId), joined.end());
+        std::vector<ChannelId>& cached = it->second.banCachedIn;
+        cached.erase(std::remove(cached.begin(), cached.end(), channelId), cached.end());
+    }
+
+    if (channel.clients.empty() && !channel.persistent) {
+        eraseChannel(channelId);
+    }
+}
+
+// Drops a pending invite on both sides
+void forgetInvite(int clientSockfd, ChannelId channelId) {
+    std::vector<int>& invited = channels[channelId].invitedUsers;
+    invited.erase(std::remove(invited.begin(), invited.end(), clientSockfd), invited.end());
+
+    std::map<int, Client>::iterator it = clients.find(clientSockfd);
+    if (it != clients.end()) {
+        std::vector<ChannelId>& invitedTo = it->second.invitedTo;
+        invitedTo.erase(std::remove(invitedTo.begin(), invitedTo.end(), channelId), invitedTo.end());
+    }
+}
+
+// Erases the channel once nobody is invited to it any more, so its id can
+// be reused without inheriting invites
+void eraseChannel(ChannelId channelId) {
+    std::vector<int> invited = channels[channelId].invitedUsers;
+    for (std::vector<int>::iterator it = invited.begin(); it != invited.end(); ++it)
+        forgetInvite(*it, channelId);
+    channels.erase(channelId);
 }
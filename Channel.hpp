@@ -2,10 +2,19 @@
 #define CHANNEL_HPP
 
 #include "Kek.hpp"
+#include "Mask.hpp"
 #include <map>
 #include <string>
 #include <vector>
 #include <set>
+#include <deque>
+
+// Cached +b/+e verdict for one client, valid while both generations match
+struct BanCacheEntry {
+    unsigned long clientGeneration;
+    unsigned long listGeneration;
+    bool banned;
+};
 
 class Channel {
 public:
@@ -19,14 +28,56 @@ public:
     std::vector<int> operators;
     bool inviteOnly;
     bool topicRestricted;
+    bool persistent;
+    MaskList bans;
+    MaskList exceptions;
+    MaskList inviteExceptions;
+    unsigned long listGeneration;
+    std::map<int, BanCacheEntry> banCache;
 
-    Channel() : userLimit(0), inviteOnly(false), topicRestricted(false) {}
+    Channel() : userLimit(0), inviteOnly(false), topicRestricted(false), persistent(false), listGeneration(0) {}
     Channel(const std::string& channelName)
-        : name(channelName), topic(""), userLimit(10), key(""), inviteOnly(false), topicRestricted(false) {}
+        : name(channelName), topic(""), userLimit(10), key(""), inviteOnly(false), topicRestricted(false), persistent(false), listGeneration(0) {}
 };
 
+// Channels live in stable slots addressed by ChannelId. Names are resolved
+// once per command through an open-addressing hash table keyed on the
+// RFC 1459 casefolded name; slots and ids of erased channels are reused.
+class ChannelTable {
+public:
+    ChannelTable();
+
+    ChannelId find(const std::string& channelName) const;
+    ChannelId create(const std::string& channelName);
+    void erase(ChannelId id);
+
+    Channel& operator[](ChannelId id) { return _slots[id]; }
+    const Channel& operator[](ChannelId id) const { return _slots[id]; }
+    bool isActive(ChannelId id) const { return !_slots[id].name.empty(); }
+    ChannelId slotCount() const { return static_cast<ChannelId>(_slots.size()); }
+    size_t size() const { return _count; }
+    size_t indexBytes() const;
+
+private:
+    struct Bucket {
+        ChannelId id;
+        unsigned int hash;  // compared before touching the slot's name
+    };
+
+    std::deque<Channel> _slots;
+    std::vector<ChannelId> _freeSlots;
+    std::vector<Bucket> _buckets;
+    size_t _count;
+
+    static unsigned int hashName(const std::string& channelName);
+    void insert(ChannelId id, unsigned int hash);
+    void rehash(size_t bucketCount);
+};
+
+bool channelNamesEqual(const std::string& a, const std::string& b);
+
 extern std::map<int, Client> clients;
-extern std::map<std::string, Channel> channels;
+extern ChannelTable channels;
 extern int connectionCount;
 extern std::set<int> operators;
 
@@ -35,9 +86,16 @@ void handleInvite(int clientSockfd, const std::string& targetNick, const std::st
 void handleTopic(int clientSockfd, const std::string& channelName, const std::string& newTopic);
 void handleMode(int clientSockfd, const std::string& channelName, const std::string& mode, const std::string& param);
 int findClientByNick(const std::string& nick);
-bool isChannelOperator(int clientSockfd, const std::string& channelName);
-bool isClientInChannel(int clientSockfd, const std::string& channelName);
-bool doesChannelExist(const std::string& channelName);
+bool isChannelOperator(int clientSockfd, ChannelId channelId);
+bool isClientInChannel(int clientSockfd, ChannelId channelId);
+bool isBanned(int clientSockfd, ChannelId channelId);
+bool isInviteExempt(int clientSockfd, ChannelId channelId);
+void touchClientMask(int clientSockfd);
+void leaveChannel(int clientSockfd, ChannelId channelId);
+void eraseChannel(ChannelId channelId);
+void forgetInvite(int clientSockfd, ChannelId channelId);
 void sendMessage(int clientSockfd, const std::string& message);
+void flushClient(int clientSockfd);
+void removeClient(int clientSockfd);
 
 #endif // CHANNEL_HPP
@@ -0,0 +1,125 @@
+#include "Channel.hpp"
+
+// RFC 1459 casemapping: {}|^ are the lowercase forms of []\~
+static char ircToLower(char c) {
+    if (c >= 'A' && c <= '^')
+        return c + ('a' - 'A');
+    return c;
+}
+
+std::string ircCasefold(const std::string& str) {
+    std::string folded(str);
+    for (size_t i = 0; i < folded.length(); ++i)
+        folded[i] = ircToLower(folded[i]);
+    return folded;
+}
+
+bool channelNamesEqual(const std::string& a, const std::string& b) {
+    if (a.length() != b.length())
+        return false;
+    for (size_t i = 0; i < a.length(); ++i) {
+        if (ircToLower(a[i]) != ircToLower(b[i]))
+            return false;
+    }
+    return true;
+}
+
+ChannelTable::ChannelTable() : _count(0) {
+    Bucket empty = { NO_CHANNEL, 0 };
+    _buckets.assign(64, empty);
+}
+
+// FNV-1a over the casefolded name
+unsigned int ChannelTable::hashName(const std::string& channelName) {
+    unsigned int hash = 2166136261U;
+    for (size_t i = 0; i < channelName.length(); ++i) {
+        hash ^= static_cast<unsigned char>(ircToLower(channelName[i]));
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+ChannelId ChannelTable::find(const std::string& channelName) const {
+    if (channelName.empty())
+        return NO_CHANNEL;
+    unsigned int hash = hashName(channelName);
+    size_t mask = _buckets.size() - 1;
+    for (size_t b = hash & mask;; b = (b + 1) & mask) {
+        const Bucket& bucket = _buckets[b];
+        if (bucket.id == NO_CHANNEL)
+            return NO_CHANNEL;
+        if (bucket.hash == hash && channelNamesEqual(_slots[bucket.id].name, channelName))
+            return bucket.id;
+    }
+}
+
+ChannelId ChannelTable::create(const std::string& channelName) {
+    ChannelId id = find(channelName);
+    if (id != NO_CHANNEL)
+        return id;
+
+    if ((_count + 1) * 4 > _buckets.size() * 3)
+        rehash(_buckets.size() * 2);
+
+    // New slots are built in place rather than default-constructed and assigned
+    if (!_freeSlots.empty()) {
+        id = _freeSlots.back();
+        _freeSlots.pop_back();
+        _slots[id] = Channel(channelName);
+    } else {
+        id = static_cast<ChannelId>(_slots.size());
+        _slots.push_back(Channel(channelName));
+    }
+    insert(id, hashName(channelName));
+    ++_count;
+    return id;
+}
+
+// Linear probing with backward-shift deletion, so no tombstones build up
+void ChannelTable::erase(ChannelId id) {
+    if (id == NO_CHANNEL || !isActive(id))
+        return;
+
+    size_t mask = _buckets.size() - 1;
+    size_t hole = hashName(_slots[id].name) & mask;
+    while (_buckets[hole].id != id)
+        hole = (hole + 1) & mask;
+
+    for (size_t next = (hole + 1) & mask; _buckets[next].id != NO_CHANNEL; next = (next + 1) & mask) {
+        size_t home = _buckets[next].hash & mask;
+        // Move the entry back if the hole lies cyclically between its home and its slot
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            _buckets[hole] = _buckets[next];
+            hole = next;
+        }
+    }
+    _buckets[hole].id = NO_CHANNEL;
+
+    _slots[id] = Channel();
+    _freeSlots.push_back(id);
+    --_count;
+}
+
+void ChannelTable::insert(ChannelId id, unsigned int hash) {
+    size_t mask = _buckets.size() - 1;
+    size_t b = hash & mask;
+    while (_buckets[b].id != NO_CHANNEL)
+        b = (b + 1) & mask;
+    _buckets[b].id = id;
+    _buckets[b].hash = hash;
+}
+
+void ChannelTable::rehash(size_t bucketCount) {
+    std::vector<Bucket> old;
+    old.swap(_buckets);
+    Bucket empty = { NO_CHANNEL, 0 };
+    _buckets.assign(bucketCount, empty);
+    for (std::vector<Bucket>::const_iterator it = old.begin(); it != old.end(); ++it) {
+        if (it->id != NO_CHANNEL)
+            insert(it->id, it->hash);
+    }
+}
+
+size_t ChannelTable::indexBytes() const {
+    return _buckets.capacity() * sizeof(Bucket) + _freeSlots.capacity() * sizeof(ChannelId);
+}
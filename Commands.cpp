@@ -1,4 +1,11 @@
 #include "Commands.hpp"
+#include "Auth.hpp"
+#include "Capture.hpp"
+#include "Memory.hpp"
+#include "Monitor.hpp"
+#include "Query.hpp"
+#include "Recorder.hpp"
+#include <cctype>
 #include <cstdlib>
 #include <cstring>
 #include <sstream>
@@ -8,26 +15,29 @@
 int connectionCount = 0;
 
 std::map<int, std::string> clientNicks;
-std::map<std::string, int> nickToFd;
+std::map<std::string, int> nickToFd;    // keyed by the RFC 1459 casefolded nick
 
 int findClientByNick(const std::string& nick) {
-    std::map<std::string, int>::const_iterator it;
-    for (it = nickToFd.begin(); it != nickToFd.end(); ++it) {
-        if (it->first == nick) {
-            return it->second;  // Return the socket fd if the nickname is found
-        }
-    }
-    return -1;  // Return -1 if the nickname is not found
+    std::map<std::string, int>::const_iterator it = nickToFd.find(ircCasefold(nick));
+    return it == nickToFd.end() ? -1 : it->second;
 }
 
 void handleNick(int clientSockfd, const std::string& newNick) {
-    // Check if the nickname is already in use
-    if (nickToFd.find(newNick) != nickToFd.end()) {
+    // Check if the nickname is already in use; Bob and bob are the same nick,
+    // but a client may change the case of its own
+    int holder = findClientByNick(newNick);
+    if (holder != -1 && holder != clientSockfd) {
         sendMessage(clientSockfd, ":localhost 433 " + clients[clientSockfd].nickname + " " + newNick + " :Nickname already in use\r\n");
         return;
     }
 
+    // Registered clients going from one nick to another are seen by MONITOR
+    bool notify = clients[clientSockfd].authenticated && ircCasefold(clients[clientSockfd].nickname) != ircCasefold(newNick);
+    if (notify)
+        monitorOffline(clientSockfd);
+
     // Remove the old nickname if it exists
+    unindexClient(clientSockfd);
     for (std::map<std::string, int>::iterator it = nickToFd.begin(); it != nickToFd.end(); ++it) {
         if (it->second == clientSockfd) {
             nickToFd.erase(it);
@@ -36,9 +46,13 @@ void handleNick(int clientSockfd, const std::string& newNick) {
     }
 
     // Set the new nickname
-    nickToFd[newNick] = clientSockfd;
+    nickToFd[ircCasefold(newNick)] = clientSockfd;
     clientNicks[clientSockfd] = newNick;
     clients[clientSockfd].nickname = newNick;
+    touchClientMask(clientSockfd);
+    indexClient(clientSockfd);
+    if (notify)
+        monitorOnline(clientSockfd);
 
     // Send confirmation message
     sendMessage(clientSockfd, ":localhost 001 " + clients[clientSockfd].nickname + " :Nickname set to " + newNick + "\r\n");
@@ -48,19 +62,17 @@ bool isOperator(int clientSockfd) {
     return operators.find(clientSockfd) != operators.end();
 }
 
-void createChannel(int clientSockfd, const std::string& channelName) {
-    // Create the new channel
-    Channel newChannel;
-    newChannel.name = channelName;
+ChannelId createChannel(int clientSockfd, const std::string& channelName) {
+    // Create the new channel in the global channel table
+    ChannelId channelId = channels.create(channelName);
+    Channel& newChannel = channels[channelId];
     newChannel.clients.push_back(clientSockfd);
     newChannel.operators.push_back(clientSockfd); // Make the first user an operator
     newChannel.inviteOnly = false; // Initialize invite-only mode
     newChannel.userLimit = 0; // No limit by default
     newChannel.key = ""; // No key by default
     newChannel.topic = ""; // No topic by default
-
-    // Add the channel to the global channels map
-    channels[channelName] = newChannel;
+    updateChannelIndex(channelId, 0);
 
     // Send channel creation messages to the client
     std::string response = ":localhost 332 " + clients[clientSockfd].nickname + " " + channelName + " :" + newChannel.topic + "\r\n";
@@ -76,18 +88,27 @@ void createChannel(int clientSockfd, const std::string& channelName) {
     std::ostringstream oss;
     oss << ":" << clients[clientSockfd].nickname << "!" << clients[clientSockfd].nickname << "@localhost JOIN " << channelName << "\r\n";
     sendMessage(clientSockfd, oss.str().c_str());
+    return channelId;
 }
 
-std::string canJoinChannel(int clientSockfd, const std::string& channelName, const std::string& password) {
-    std::map<std::string, Channel>::iterator it = channels.find(channelName);
-    if (it == channels.end()) {
+std::string canJoinChannel(int clientSockfd, ChannelId channelId, const std::string& password) {
+    if (channelId == NO_CHANNEL) {
         return ""; // Channel doesn't exist, so it can be created
     }
 
-    Channel& channel = it->second;
+    Channel& channel = channels[channelId];
+    const std::string& channelName = channel.name;
+    bool invited = std::find(channel.invitedUsers.begin(), channel.invitedUsers.end(), clientSockfd) != channel.invitedUsers.end();
+
+    // Check ban list (+b, unless matched by +e); an invite overrides a ban
+    if (!invited && isBanned(clientSockfd, channelId)) {
+        sendMessage(clientSockfd, ":localhost 474 " + clients[clientSockfd].nickname + " " + channelName + " :Cannot join channel (+b)\r\n");
+        return "error";
+    }
+
     // Check invite-only mode
     if (channel.inviteOnly) {
-        if (std::find(channel.invitedUsers.begin(), channel.invitedUsers.end(), clientSockfd) == channel.invitedUsers.end()) {
+        if (!invited && !isInviteExempt(clientSockfd, channelId)) {
             sendMessage(clientSockfd, ":localhost 473 " + clients[clientSockfd].nickname + " " + channelName + " :You must be invited to join this channel\r\n");
             return "error";  // Return empty to indicate an error was sent but no further processing needed
         }
@@ -110,7 +131,7 @@ std::string canJoinChannel(int clientSockfd, const std::string& channelName, con
 
 void handleJoin(int clientSockfd, const std::string& channelName, const std::string& password) {
     // Check if the channel name is valid
-    if (channelName.empty() || channelName[0] != '#' || channelName.length() > 50) {
+    if (channelName.empty() || channelName[0] != '#' || channelName.length() > MAX_CHANNEL_NAME_LENGTH) {
         sendMessage(clientSockfd, ":localhost 403 " + clients[clientSockfd].nickname + " " + channelName + " :No such channel\r\n");
         return;
     }
@@ -126,33 +147,42 @@ void handleJoin(int clientSockfd, const std::string& channelName, const std::str
     }
 
     Client& client = clients[clientSockfd];
+    ChannelId channelId = channels.find(channelName);
 
     // Check if user is already in the channel
-    if (std::find(client.channels.begin(), client.channels.end(), channelName) != client.channels.end()) {
+    if (channelId != NO_CHANNEL && std::find(client.channels.begin(), client.channels.end(), channelId) != client.channels.end()) {
         std::string response = ":localhost 443 " + clients[clientSockfd].nickname + " " + channelName + " :You are already in the channel\r\n";
         sendMessage(clientSockfd, response.c_str());
         return;
     }
 
+    if (client.channels.size() >= MAX_CHANNELS_PER_CLIENT) {
+        sendMessage(clientSockfd, ":localhost 405 " + client.nickname + " " + channelName + " :You have joined too many channels\r\n");
+        return;
+    }
+
     // Check if the user can join the channel
-    std::string errorMsg = canJoinChannel(clientSockfd, channelName, password);
+    std::string errorMsg = canJoinChannel(clientSockfd, channelId, password);
     if (!errorMsg.empty()) {
         sendMessage(clientSockfd, ":localhost 475 " + clients[clientSockfd].nickname + " " + channelName + " :Cannot join channel (+k or +i)\r\n");
         return;
     }
 
-    // Check if the channel exists
-    std::map<std::string, Channel>::iterator it = channels.find(channelName);
-
-    if (it == channels.end()) {
+    if (channelId == NO_CHANNEL) {
         // If channel doesn't exist, call createChannel to create the channel
-        createChannel(clientSockfd, channelName);
+        channelId = createChannel(clientSockfd, channelName);
     } else {
         // Channel exists; add the client to it
-        Channel& channel = it->second;
+        Channel& channel = channels[channelId];
+
+        // A persistent channel can be empty, and then nobody holds ops: the
+        // first to join takes them, as when a channel is created
+        if (channel.clients.empty())
+            channel.operators.push_back(clientSockfd);
 
         // Add the client to the channel's client list
         channel.clients.push_back(clientSockfd);
+        updateChannelIndex(channelId, channel.clients.size() - 1);
 
         // Send channel join confirmation
         std::string response = ":localhost 353 " + clients[clientSockfd].nickname + " = " + channelName + " :";
@@ -161,58 +191,54 @@ void handleJoin(int clientSockfd, const std::string& channelName, const std::str
             userList << clients[*it].nickname << " ";
         }
         response += userList.str();
-        send(clientSockfd, response.c_str(), response.length(), 0);
+        sendMessage(clientSockfd, response);
 
         // Notify other clients in the channel about the new member
         std::ostringstream oss;
         oss << ":" << clients[clientSockfd].nickname << "!" << clients[clientSockfd].nickname << "@localhost JOIN " << channelName << "\r\n";
+        traceMark(TRACE_FANOUT_START);
         for (std::vector<int>::iterator clientIt = channel.clients.begin(); clientIt != channel.clients.end(); ++clientIt) {
-            send(*clientIt, oss.str().c_str(), oss.str().length(), 0);
+            sendMessage(*clientIt, oss.str());
         }
+        traceFanout(channel.clients.size());
+        traceMark(TRACE_FANOUT_END);
     }
 
-    // Add the channel to the user's list of channels
-    client.channels.push_back(channelName);
+    // Add the channel to the user's list of channels; joining uses up an invite
+    client.channels.push_back(channelId);
+    forgetInvite(clientSockfd, channelId);
 }
 
 void handlePart(int clientSockfd, const std::string& channelName) {
-    if (clients.find(clientSockfd) == clients.end() || channels.find(channelName) == channels.end()) {
+    ChannelId channelId = channels.find(channelName);
+    if (clients.find(clientSockfd) == clients.end() || channelId == NO_CHANNEL) {
         std::string response = "Error: Channel or user not found.\n";
-        send(clientSockfd, response.c_str(), response.length(), 0);
+        sendMessage(clientSockfd, response);
         return;
     }
 
     Client& client = clients[clientSockfd];
-    Channel& channel = channels[channelName];
+    Channel& channel = channels[channelId];
 
-    // Remove user from channel
-    channel.clients.erase(std::remove(channel.clients.begin(), channel.clients.end(), clientSockfd), channel.clients.end());
-    channel.operators.erase(std::remove(channel.operators.begin(), channel.operators.end(), clientSockfd), channel.operators.end());
+    std::string response = "Left channel " + channel.name + ".\n";
+    sendMessage(clientSockfd, response);
 
-    // Remove channel from user's list
-    client.channels.erase(std::remove(client.channels.begin(), client.channels.end(), channelName), client.channels.end());
-
-    std::string response = "Left channel " + channelName + ".\n";
-    send(clientSockfd, response.c_str(), response.length(), 0);
+    // Remove user from channel; an empty channel is erased
+    leaveChannel(clientSockfd, channelId);
 
     // Notify other users in the channel
     std::string notification = "User " + client.nickname + " has left the channel.\n";
     for (std::vector<int>::const_iterator it = channel.clients.begin(); it != channel.clients.end(); ++it) {
-        send(*it, notification.c_str(), notification.length(), 0);
-    }
-
-    // If channel is empty, remove it
-    if (channel.clients.empty()) {
-        channels.erase(channelName);
+        sendMessage(*it, notification);
     }
 }
 
 void handleChatMsg(int clientSockfd, const std::string& channelName, const std::string& msg) {
     // Find the channel
-    std::map<std::string, Channel>::iterator it = channels.find(channelName);
+    ChannelId channelId = channels.find(channelName);
 
-    if (it != channels.end()) {
-        Channel& channel = it->second;
+    if (channelId != NO_CHANNEL) {
+        Channel& channel = channels[channelId];
 
         // Check if the client is part of the channel
         bool isClientInChannel = false;
@@ -223,91 +249,100 @@ void handleChatMsg(int clientSockfd, const std::string& channelName, const std::
             }
         }
 
-        if (isClientInChannel) {
+        if (isClientInChannel && isBanned(clientSockfd, channelId)) {
+            std::string response = ":localhost 404 " + clients[clientSockfd].nickname + " " + channelName + " :Cannot send to channel (+b)\r\n";
+            sendMessage(clientSockfd, response);
+        } else if (isClientInChannel) {
             // Send the message to all clients in the channel
+            traceMark(TRACE_FANOUT_START);
             for (std::vector<int>::iterator itClient = channel.clients.begin(); itClient != channel.clients.end(); ++itClient) {
                 if (*itClient != clientSockfd) { // Don't send the message to the sender
                     std::string response = ":" + clients[clientSockfd].nickname + " PRIVMSG " + channelName + " :" + msg + "\r\n";
-                    send(*itClient, response.c_str(), response.length(), 0);
+                    sendMessage(*itClient, response);
                 }
             }
+            traceFanout(channel.clients.size() - 1);
+            traceMark(TRACE_FANOUT_END);
 
             // Optionally, send a confirmation back to the sender
             std::string response = "Message sent to channel " + channelName + ": " + msg + "\r\n";
-            send(clientSockfd, response.c_str(), response.length(), 0);
+            sendMessage(clientSockfd, response);
         } else {
             // If the client is not part of the channel, notify them
             std::string response = ":localhost 442 " + clients[clientSockfd].nickname + " " + channelName + " :You're not on that channel\r\n";
-            send(clientSockfd, response.c_str(), response.length(), 0);
+            sendMessage(clientSockfd, response);
         }
     } else {
         // If the channel doesn't exist, notify the sender
         std::string response = ":localhost 403 " + clients[clientSockfd].nickname + " " + channelName + " :No such channel\r\n";
-        send(clientSockfd, response.c_str(), response.length(), 0);
+        sendMessage(clientSockfd, response);
     }
 }
 
 
 void handleInvite(int clientSockfd, const std::string& channelName, const std::string& target) {
     // Find the channel
-    std::map<std::string, Channel>::iterator it = channels.find(channelName);
+    ChannelId channelId = channels.find(channelName);
 
-    if (it != channels.end()) {
-        Channel& channel = it->second;
+    if (channelId != NO_CHANNEL) {
+        Channel& channel = channels[channelId];
 
         // Check if the client is an operator in the channel
         if (std::find(channel.operators.begin(), channel.operators.end(), clientSockfd) != channel.operators.end()) {
             // Find the target client
-            std::map<std::string, int>::iterator targetIt = nickToFd.find(target);
+            std::map<std::string, int>::iterator targetIt = nickToFd.find(ircCasefold(target));
 
             if (targetIt != nickToFd.end()) {
                 int targetSockfd = targetIt->second;
 
                 // Invite the client to the channel
-                channel.invitedUsers.push_back(targetSockfd);
+                if (std::find(channel.invitedUsers.begin(), channel.invitedUsers.end(), targetSockfd) == channel.invitedUsers.end()) {
+                    channel.invitedUsers.push_back(targetSockfd);
+                    clients[targetSockfd].invitedTo.push_back(channelId);
+                }
 
                 // Send an invitation message to the target client
                 std::string response = ":localhost 341 " + clients[clientSockfd].nickname + " " + target + " " + channelName + " :You have been invited to join the channel\r\n";
-                send(targetSockfd, response.c_str(), response.length(), 0);
+                sendMessage(targetSockfd, response);
 
                 // Optionally, send a confirmation back to the inviter
                 response = ":localhost 341 " + clients[clientSockfd].nickname + " " + target + " " + channelName + " :Invitation sent\r\n";
-                send(clientSockfd, response.c_str(), response.length(), 0);
+                sendMessage(clientSockfd, response);
             } else {
                 // If the target client doesn't exist, notify the inviter
                 std::string response = ":localhost 401 " + clients[clientSockfd].nickname + " " + target + " :No such nick\r\n";
-                send(clientSockfd, response.c_str(), response.length(), 0);
+                sendMessage(clientSockfd, response);
             }
         } else {
             // If the client is not an operator in the channel, notify them
             std::string response = ":localhost 482 " + clients[clientSockfd].nickname + " " + channelName + " :You're not a channel operator\r\n";
-            send(clientSockfd, response.c_str(), response.length(), 0);
+            sendMessage(clientSockfd, response);
         }
     } else {
         // If the channel doesn't exist, notify the inviter
         std::string response = ":localhost 403 " + clients[clientSockfd].nickname + " " + channelName + " :No such channel\r\n";
-        send(clientSockfd, response.c_str(), response.length(), 0);
+        sendMessage(clientSockfd, response);
     }
 }
 
 void handlePrivMsg(int clientSockfd, const std::string& target, const std::string& msg) {
     // Check if the target is in the nickname-to-socket map
-    std::map<std::string, int>::iterator it = nickToFd.find(target);
+    std::map<std::string, int>::iterator it = nickToFd.find(ircCasefold(target));
 
     if (it != nickToFd.end()) {
         int targetSockfd = it->second; // Get the socket ID of the target client
 
         // Send the private message to the target client
         std::string response = ":localhost 341 " + clients[clientSockfd].nickname + " PRIVMSG " + target + " :" + msg + "\r\n";
-        send(targetSockfd, response.c_str(), response.length(), 0);
+        sendMessage(targetSockfd, response);
 
         // Optionally, send a confirmation back to the sender (this is how irssi works)
         std::string ackResponse = ":localhost 341 PRIVMSG " + clients[clientSockfd].nickname + " :" + msg + "\r\n";
-        send(clientSockfd, ackResponse.c_str(), ackResponse.length(), 0);
+        sendMessage(clientSockfd, ackResponse);
     } else {
         // If the target client is not found, notify the sender with the "No such nick" error (401)
         std::string errorResponse = ":localhost 401 " + clients[clientSockfd].nickname + " " + target + " :No such nick\r\n";
-        send(clientSockfd, errorResponse.c_str(), errorResponse.length(), 0);
+        sendMessage(clientSockfd, errorResponse);
     }
 }
 
@@ -324,6 +359,7 @@ void processMessage(const std::string& message, int clientSockfd) {
     }
 
     std::cout << message << " here is it" << std::endl;
+    traceMark(TRACE_DISPATCH);
 
     // Global commands
     if (command == "NICK") {
@@ -341,21 +377,14 @@ void processMessage(const std::string& message, int clientSockfd) {
         if (!target.empty() && !msg.empty()) {
             // Check if the target is a valid channel or user
             if (target[0] == '#') {
-                // Target is a channel
-                // Check if the channel exists
-                std::map<std::string, Channel>::iterator it = channels.find(target);
-                if (it != channels.end()) {
-                    // Send message to all clients in the channel
-                    handleChatMsg(clientSockfd, target, msg);
-                } else {
-                    sendMessage(clientSockfd, ":localhost 403 " + clients[clientSockfd].nickname + " " + target + " :No such channel\r\n");
-                }
+                // Target is a channel; handleChatMsg answers 403 if it doesn't exist
+                handleChatMsg(clientSockfd, target, msg);
             } else {
                 // Target is a user (find the user by nickname)
-                std::map<std::string, int>::iterator nicknameIt = nickToFd.find(target);
+                std::map<std::string, int>::iterator nicknameIt = nickToFd.find(ircCasefold(target));
                 if (nicknameIt != nickToFd.end()) {
                     //int targetSockfd = nicknameIt->second; // Get the socket of the target user
-                    handlePrivMsg(clientSockfd, nicknameIt->first, msg);
+                    handlePrivMsg(clientSockfd, target, msg);
                 } else {
                     sendMessage(clientSockfd, ":localhost 401 " + clients[clientSockfd].nickname + " " + target + " :No such nick\r\n");
                 }
@@ -433,6 +462,77 @@ void processMessage(const std::string& message, int clientSockfd) {
             std::string errorMsg = ":localhost 461 " + clients[clientSockfd].nickname + " " + command + " :Not enough parameters\r\n";
             sendMessage(clientSockfd, errorMsg.c_str());
         }
+    } else if (command == "LIST") {
+        handleList(clientSockfd, args);
+    } else if (command == "WHO") {
+        handleWho(clientSockfd, args);
+    } else if (command == "WHOIS") {
+        handleWhois(clientSockfd, args);
+    } else if (command == "RECORDER") {
+        // RECORDER <N> samples one line in N, RECORDER OFF stops, RECORDER DUMP writes the ring
+        char *end = NULL;
+        long rate = args.empty() || !std::isdigit(static_cast<unsigned char>(args[0])) ? 0 : std::strtol(args.c_str(), &end, 10);
+        if (!isOperator(clientSockfd)) {
+            sendMessage(clientSockfd, ":localhost 481 " + clients[clientSockfd].nickname + " :Permission Denied- You're not an IRC operator\r\n");
+        } else if (args == "DUMP") {
+            std::string path = traceDump();
+            sendMessage(clientSockfd, ":localhost NOTICE " + clients[clientSockfd].nickname + " :" + (path.empty() ? "Trace dump failed" : "Trace written to " + path) + "\r\n");
+        } else if (args == "OFF") {
+            traceSetSampleRate(0);
+            sendMessage(clientSockfd, ":localhost NOTICE " + clients[clientSockfd].nickname + " :Recording stopped\r\n");
+        } else if (rate > 0 && rate <= TRACE_MAX_SAMPLE_RATE && *end == '\0') {
+            traceSetSampleRate(static_cast<unsigned int>(rate));
+            std::ostringstream oss;
+            oss << ":localhost NOTICE " << clients[clientSockfd].nickname << " :Recording 1 line in " << traceSampleRate() << "\r\n";
+            sendMessage(clientSockfd, oss.str());
+        } else if (!args.empty()) {
+            std::ostringstream oss;
+            oss << ":localhost 461 " << clients[clientSockfd].nickname << " RECORDER :Sample rate must be between 1 and " << TRACE_MAX_SAMPLE_RATE << "\r\n";
+            sendMessage(clientSockfd, oss.str());
+        } else {
+            sendMessage(clientSockfd, ":localhost 461 " + clients[clientSockfd].nickname + " RECORDER :Not enough parameters\r\n");
+        }
+    } else if (command == "MONITOR") {
+        handleMonitor(clientSockfd, args);
+    } else if (command == "OPER") {
+        std::istringstream iss(args);
+        std::string name, password;
+        if (!(iss >> name >> password)) {
+            sendMessage(clientSockfd, ":localhost 461 " + clients[clientSockfd].nickname + " OPER :Not enough parameters\r\n");
+        } else if (!authSubmitOper(clientSockfd, name, password)) {
+            sendMessage(clientSockfd, ":localhost 263 " + clients[clientSockfd].nickname + " OPER :Server load is temporarily too heavy. Please wait a while and try again.\r\n");
+        }
+    } else if (command == "PING") {
+        sendMessage(clientSockfd, ":localhost PONG localhost :" + (args.empty() || args[0] != ':' ? args : args.substr(1)) + "\r\n");
+    } else if (command == "CAPTURE") {
+        // CAPTURE START records inbound traffic for tools/replay until CAPTURE STOP
+        const std::string& nick = clients[clientSockfd].nickname;
+        if (!isOperator(clientSockfd)) {
+            sendMessage(clientSockfd, ":localhost 481 " + nick + " :Permission Denied- You're not an IRC operator\r\n");
+        } else if (args == "START") {
+            std::string file = captureStart();
+            sendMessage(clientSockfd, ":localhost NOTICE " + nick + " :" + (file.empty() ? "Capture failed" : "Capturing to " + file) + "\r\n");
+        } else if (args == "STOP") {
+            unsigned long records;
+            std::string file = captureStop(records);
+            std::ostringstream oss;
+            oss << ":localhost NOTICE " << nick << " :";
+            if (file.empty())
+                oss << "No capture running";
+            else
+                oss << "Captured " << records << " records to " << file;
+            sendMessage(clientSockfd, oss.str() + "\r\n");
+        } else {
+            sendMessage(clientSockfd, ":localhost 461 " + nick + " CAPTURE :Not enough parameters\r\n");
+        }
+    } else if (command == "STATS") {
+        if (args == "z") {
+            sendMemoryStats(clientSockfd);
+        } else if (args == "a") {
+            sendAuthStats(clientSockfd);
+        } else {
+            sendMessage(clientSockfd, ":localhost 219 " + clients[clientSockfd].nickname + " " + args + " :End of STATS report\r\n");
+        }
     } else {
         std::string errorMsg = ":localhost 421 " + clients[clientSockfd].nickname + " " + command + " :Unknown command\r\n";
         sendMessage(clientSockfd, errorMsg.c_str());
@@ -441,13 +541,37 @@ void processMessage(const std::string& message, int clientSockfd) {
 
 void removeClient(int clientSockfd) {
     // Remove the client's nickname from the maps
+    cancelQueries(clientSockfd);
+    monitorRemoveClient(clientSockfd);
+    if (clients[clientSockfd].authenticated)
+        monitorOffline(clientSockfd);
+    unindexClient(clientSockfd);
     std::string nick = clients[clientSockfd].nickname;
+    std::vector<ChannelId> joined = clients[clientSockfd].channels;
+    std::vector<ChannelId> invitedTo = clients[clientSockfd].invitedTo;
+    std::vector<ChannelId> banCachedIn = clients[clientSockfd].banCachedIn;
     clients.erase(clientSockfd);
-    nickToFd.erase(nick);
+    clientNicks.erase(clientSockfd);
+    operators.erase(clientSockfd);
+    std::map<std::string, int>::iterator nickIt = nickToFd.find(ircCasefold(nick));
+    if (nickIt != nickToFd.end() && nickIt->second == clientSockfd) {
+        nickToFd.erase(nickIt);
+    }
+
+    // Remove the client from its channels, dropping the ones left empty
+    for (std::vector<ChannelId>::iterator it = joined.begin(); it != joined.end(); ++it) {
+        leaveChannel(clientSockfd, *it);
+    }
+
+    // Forget pending invites so a reused fd doesn't inherit them
+    for (std::vector<ChannelId>::iterator it = invitedTo.begin(); it != invitedTo.end(); ++it) {
+        if (channels.isActive(*it))
+            forgetInvite(clientSockfd, *it);
+    }
 
-    // Remove the client from all channels
-    for (std::map<std::string, Channel>::iterator it = channels.begin(); it != channels.end(); ++it) {
-        std::vector<int>& clientsList = it->second.clients;
-        clientsList.erase(std::remove(clientsList.begin(), clientsList.end(), clientSockfd), clientsList.end());
+    // Ban verdicts cached for channels probed without joining
+    for (std::vector<ChannelId>::iterator it = banCachedIn.begin(); it != banCachedIn.end(); ++it) {
+        if (channels.isActive(*it))
+            channels[*it].banCache.erase(clientSockfd);
     }
 }
@@ -6,7 +6,7 @@
 bool isOperator(int clientSockfd);
 void processMessage(const std::string& message, int clientSockfd);
 int findClientByNick(const std::string& nick);
-void createChannel(int clientSockfd, const std::string& channelName);
+ChannelId createChannel(int clientSockfd, const std::string& channelName);
 void handlePrivMsg(int clientSockfd, const std::string& targetNick, const std::string& message);
 void handleChatMsg(int clientSockfd, const std::string& channelName, const std::string& message);
 void handleNick(int clientSockfd, const std::string& newNick);
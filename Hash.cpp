@@ -0,0 +1,227 @@
+#include "Hash.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <unistd.h>
+
+static const uint32_t roundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256Compress(uint32_t state[8], const unsigned char block[64]) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (static_cast<uint32_t>(block[i * 4]) << 24) | (static_cast<uint32_t>(block[i * 4 + 1]) << 16)
+             | (static_cast<uint32_t>(block[i * 4 + 2]) << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + roundConstants[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256Init(Sha256& ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    std::memcpy(ctx.state, initial, sizeof(initial));
+    ctx.length = 0;
+    ctx.used = 0;
+}
+
+void sha256Update(Sha256& ctx, const unsigned char *data, size_t length) {
+    ctx.length += length;
+    while (length > 0) {
+        size_t take = 64 - ctx.used < length ? 64 - ctx.used : length;
+        std::memcpy(ctx.block + ctx.used, data, take);
+        ctx.used += take;
+        data += take;
+        length -= take;
+        if (ctx.used == 64) {
+            sha256Compress(ctx.state, ctx.block);
+            ctx.used = 0;
+        }
+    }
+}
+
+void sha256Final(Sha256& ctx, unsigned char digest[SHA256_DIGEST_BYTES]) {
+    uint64_t bits = ctx.length * 8;
+    unsigned char pad = 0x80;
+    sha256Update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx.used != 56)
+        sha256Update(ctx, &pad, 1);
+
+    unsigned char lengthBytes[8];
+    for (int i = 0; i < 8; ++i)
+        lengthBytes[i] = static_cast<unsigned char>(bits >> (56 - i * 8));
+    sha256Update(ctx, lengthBytes, 8);
+
+    for (int i = 0; i < 8; ++i) {
+        digest[i * 4] = static_cast<unsigned char>(ctx.state[i] >> 24);
+        digest[i * 4 + 1] = static_cast<unsigned char>(ctx.state[i] >> 16);
+        digest[i * 4 + 2] = static_cast<unsigned char>(ctx.state[i] >> 8);
+        digest[i * 4 + 3] = static_cast<unsigned char>(ctx.state[i]);
+    }
+}
+
+// The keyed inner and outer states are computed once and copied for every
+// HMAC, so each PBKDF2 iteration costs two compressions instead of four.
+void pbkdf2Sha256(const std::string& password, const std::string& salt, unsigned int iterations,
+                  unsigned char *key, size_t keyLength) {
+    unsigned char block[64];
+    std::memset(block, 0, sizeof(block));
+    if (password.length() > sizeof(block)) {
+        Sha256 ctx;
+        sha256Init(ctx);
+        sha256Update(ctx, reinterpret_cast<const unsigned char*>(password.data()), password.length());
+        sha256Final(ctx, block);
+    } else {
+        std::memcpy(block, password.data(), password.length());
+    }
+
+    unsigned char innerPad[64], outerPad[64];
+    for (int i = 0; i < 64; ++i) {
+        innerPad[i] = block[i] ^ 0x36;
+        outerPad[i] = block[i] ^ 0x5c;
+    }
+    Sha256 inner, outer;
+    sha256Init(inner);
+    sha256Update(inner, innerPad, sizeof(innerPad));
+    sha256Init(outer);
+    sha256Update(outer, outerPad, sizeof(outerPad));
+
+    for (uint32_t blockIndex = 1; keyLength > 0; ++blockIndex) {
+        unsigned char counter[4] = {
+            static_cast<unsigned char>(blockIndex >> 24), static_cast<unsigned char>(blockIndex >> 16),
+            static_cast<unsigned char>(blockIndex >> 8), static_cast<unsigned char>(blockIndex)
+        };
+        unsigned char u[SHA256_DIGEST_BYTES], t[SHA256_DIGEST_BYTES];
+
+        Sha256 ctx = inner;
+        sha256Update(ctx, reinterpret_cast<const unsigned char*>(salt.data()), salt.length());
+        sha256Update(ctx, counter, sizeof(counter));
+        sha256Final(ctx, u);
+        ctx = outer;
+        sha256Update(ctx, u, sizeof(u));
+        sha256Final(ctx, u);
+        std::memcpy(t, u, sizeof(t));
+
+        for (unsigned int i = 1; i < iterations; ++i) {
+            ctx = inner;
+            sha256Update(ctx, u, sizeof(u));
+            sha256Final(ctx, u);
+            ctx = outer;
+            sha256Update(ctx, u, sizeof(u));
+            sha256Final(ctx, u);
+            for (size_t j = 0; j < sizeof(t); ++j)
+                t[j] ^= u[j];
+        }
+
+        size_t take = keyLength < sizeof(t) ? keyLength : sizeof(t);
+        std::memcpy(key, t, take);
+        key += take;
+        keyLength -= take;
+    }
+}
+
+static std::string toHex(const unsigned char *data, size_t length) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < length; ++i) {
+        hex += digits[data[i] >> 4];
+        hex += digits[data[i] & 0xF];
+    }
+    return hex;
+}
+
+static bool fromHex(const std::string& hex, std::string& out) {
+    if (hex.empty() || hex.length() % 2 != 0)
+        return false;
+    out.clear();
+    for (size_t i = 0; i < hex.length(); i += 2) {
+        char pair[3] = { hex[i], hex[i + 1], '\0' };
+        char *end;
+        long value = std::strtol(pair, &end, 16);
+        if (*end != '\0')
+            return false;
+        out += static_cast<char>(value);
+    }
+    return true;
+}
+
+static bool parseCredential(const std::string& credential, unsigned int& iterations, std::string& salt, std::string& key) {
+    if (credential.compare(0, std::strlen(CREDENTIAL_PREFIX), CREDENTIAL_PREFIX) != 0)
+        return false;
+    std::istringstream iss(credential.substr(std::strlen(CREDENTIAL_PREFIX)));
+    std::string iterationField, saltField, keyField;
+    if (!std::getline(iss, iterationField, '$') || !std::getline(iss, saltField, '$') || !std::getline(iss, keyField))
+        return false;
+    iterations = std::strtoul(iterationField.c_str(), NULL, 10);
+    return iterations > 0 && fromHex(saltField, salt) && fromHex(keyField, key) && key.length() <= SHA256_DIGEST_BYTES;
+}
+
+bool isCredential(const std::string& str) {
+    unsigned int iterations;
+    std::string salt, key;
+    return parseCredential(str, iterations, salt, key);
+}
+
+// Returns "" if no random salt could be read
+std::string makeCredential(const std::string& password, unsigned int iterations) {
+    unsigned char salt[PBKDF2_SALT_BYTES];
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0)
+        return "";
+    ssize_t got = read(fd, salt, sizeof(salt));
+    close(fd);
+    if (got != static_cast<ssize_t>(sizeof(salt)))
+        return "";
+
+    unsigned char key[SHA256_DIGEST_BYTES];
+    pbkdf2Sha256(password, std::string(reinterpret_cast<char*>(salt), sizeof(salt)), iterations, key, sizeof(key));
+
+    std::ostringstream oss;
+    oss << CREDENTIAL_PREFIX << iterations << "$" << toHex(salt, sizeof(salt)) << "$" << toHex(key, sizeof(key));
+    return oss.str();
+}
+
+// Compares every byte so the time taken does not reveal the matching prefix
+bool verifyCredential(const std::string& password, const std::string& credential) {
+    unsigned int iterations;
+    std::string salt, expected;
+    if (!parseCredential(credential, iterations, salt, expected))
+        return false;
+
+    unsigned char key[SHA256_DIGEST_BYTES];
+    pbkdf2Sha256(password, salt, iterations, key, expected.length());
+
+    unsigned char diff = 0;
+    for (size_t i = 0; i < expected.length(); ++i)
+        diff |= key[i] ^ static_cast<unsigned char>(expected[i]);
+    return diff == 0;
+}
@@ -0,0 +1,34 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+// Password credentials are PBKDF2-HMAC-SHA256, stored as
+// $pbkdf2-sha256$<iterations>$<salt hex>$<key hex>
+
+#define CREDENTIAL_PREFIX "$pbkdf2-sha256$"
+#define PBKDF2_DEFAULT_ITERATIONS 20000
+#define PBKDF2_SALT_BYTES 16
+#define SHA256_DIGEST_BYTES 32
+
+struct Sha256 {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+};
+
+void sha256Init(Sha256& ctx);
+void sha256Update(Sha256& ctx, const unsigned char *data, size_t length);
+void sha256Final(Sha256& ctx, unsigned char digest[SHA256_DIGEST_BYTES]);
+
+void pbkdf2Sha256(const std::string& password, const std::string& salt, unsigned int iterations,
+                  unsigned char *key, size_t keyLength);
+
+bool isCredential(const std::string& str);
+std::string makeCredential(const std::string& password, unsigned int iterations);
+bool verifyCredential(const std::string& password, const std::string& credential);
+
+#endif // HASH_HPP
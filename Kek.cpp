@@ -1,14 +1,27 @@
 #include "Channel.hpp"
 #include "Commands.hpp"
 #include "Kek.hpp"
+#include "Tls.hpp"
+#include "Auth.hpp"
+#include "Capture.hpp"
+#include "Memory.hpp"
+#include "Monitor.hpp"
+#include "LowLatency.hpp"
+#include "Query.hpp"
+#include "Recorder.hpp"
+#include "Scanner.hpp"
+#include "Registry.hpp"
 #include <sys/socket.h>
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <poll.h>
+#include <cerrno>
 #include <map>
 
 #define BUFFER_SIZE 1024
@@ -19,19 +32,150 @@ std::string trim(const std::string &str) {
     return (first == std::string::npos || last == std::string::npos) ? "" : str.substr(first, last - first + 1);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <port> <password>" << std::endl;
-        return 1;
+// Replies are small and sent as soon as they are ready; with Nagle they
+// would wait for the client's delayed ACK of the previous one
+static void setNoDelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Clients are known, and matched against bans, by their address; the
+// hostname sent with USER is not trusted
+static std::string peerAddress(int fd) {
+    sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    char host[INET_ADDRSTRLEN];
+    if (getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &length) < 0
+        || !inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host)))
+        return "unknown";
+    return host;
+}
+
+void disconnectClient(std::vector<pollfd>& fds, size_t index) {
+    int fd = fds[index].fd;
+    std::map<int, Client>::iterator it = clients.find(fd);
+    if (it != clients.end() && !it->second.quitReason.empty()) {
+        flushClient(fd);
+        std::string errorMsg = "ERROR :Closing link (" + it->second.quitReason + ")\r\n";
+        send(fd, errorMsg.c_str(), errorMsg.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
     }
+    close(fd);
+    captureClose(fd);
+    removeClient(fd);
+    fds.erase(fds.begin() + index);
+}
 
-    int port = std::atoi(argv[1]);
-    std::string password = argv[2];
+// Handles the complete lines in the client's buffer, stopping early while
+// an authentication check for the client is still running
+void processLines(int fd, uint64_t recvTime) {
+    static std::vector<LineSpan> lines;
+    lines.clear();
+    scanLines(clients[fd].buffer.data(), clients[fd].buffer.length(), lines);
+
+    size_t done = 0;
+    for (size_t l = 0; l < lines.size() && !clients[fd].authPending; l++) {
+        const LineSpan& line = lines[l];
+        size_t lineLength = line.end - done;
+        done = line.end;
+        if (lineLength > MAX_LINE_LENGTH) {
+            sendMessage(fd, ":localhost 417 * :Input line was too long\r\n");
+            continue;
+        }
+        captureLine(fd, clients[fd].buffer.data() + line.start, line.length);
+        if (line.flags) {
+            const std::string& nick = clients[fd].nickname.empty() ? "*" : clients[fd].nickname;
+            sendMessage(fd, ":localhost 400 " + nick + " * :Input line " + ((line.flags & LINE_ILLEGAL_BYTE) ? "contains a NUL or stray CR" : "is not valid UTF-8") + "\r\n");
+            continue;
+        }
+        if (line.length == 0)
+            continue;
+
+        std::string message = clients[fd].buffer.substr(line.start, line.length);
+        traceBegin(fd, recvTime, message.data(), message.size());
+        traceMark(TRACE_PARSE);
 
+        if (clients[fd].authenticated)
+        {
+            processMessage(message, fd);
+            continue;
+        }
+
+        if (message.substr(0, 3) == "CAP") {
+            if (message.find("LS") != std::string::npos) {
+                sendMessage(fd, "CAP * LS\r\n"); // No capabilities
+            } else if (message.find("REQ") != std::string::npos) {
+                // Handle capability requests as needed
+            } else if (message.find("END") != std::string::npos) {
+                sendMessage(fd, "CAP * ACK\r\n");
+            }
+            continue;
+        }
+
+        // PASS, NICK and USER take their argument from the sixth byte on
+        std::string command = message.substr(0, 4);
+        if ((command == "PASS" || command == "NICK" || command == "USER") && message.length() <= 5) {
+            const std::string& nick = clients[fd].nickname.empty() ? "*" : clients[fd].nickname;
+            sendMessage(fd, ":localhost 461 " + nick + " " + command + " :Not enough parameters\r\n");
+            continue;
+        }
+
+        if (!clients[fd].passwordVerified) {
+            if (message.substr(0, 4) == "PASS") {
+                // Checked off-loop; the remaining lines wait until the result is in
+                if (!authSubmitPass(fd, message.substr(5)))
+                    sendMessage(fd, ":localhost 263 * PASS :Server load is temporarily too heavy. Please wait a while and try again.\r\n");
+                continue;
+            }
+        }
+
+        if (clients[fd].passwordVerified) {
+            if (message.substr(0, 4) == "NICK") {
+                handleNick(fd, message.substr(5));
+                clients[fd].nickReceived = (findClientByNick(message.substr(5)) == fd);
+            }
+
+            if (message.substr(0, 4) == "USER") {
+                // Parse USER command
+                std::istringstream iss(message.substr(5));
+                std::string username, hostname, servername, realname;
+                iss >> username >> hostname >> servername;
+                std::getline(iss, realname);
+                realname = trim(realname);
+
+                if (username.empty() || realname.empty()) {
+                    sendMessage(fd, "461 USER :Not enough parameters\r\n");
+                    continue;
+                }
+
+                unindexClient(fd);
+                clients[fd].username = username;
+                clients[fd].servername = servername;
+                clients[fd].realname = realname;
+                clients[fd].userReceived = true;
+                touchClientMask(fd);
+                indexClient(fd);
+            }
+
+            // After both NICK and USER, authenticate the user
+            if (clients[fd].nickReceived && clients[fd].userReceived) {
+                clients[fd].authenticated = true;
+
+                std::string welcomeMsg = std::string(":") + "irc.localhost" + " 001 " + clients[fd].nickname +
+                                        " :Welcome to the IRC Network, " + clients[fd].nickname + "\r\n";
+                sendMessage(fd, welcomeMsg);
+                monitorOnline(fd);
+                std::cout << "Received msg: '" << message << "'" << std::endl; // Debugging output
+            }
+        }
+    }
+    clients[fd].buffer.erase(0, done);
+}
+
+int createListener(int port) {
     int serverSock = socket(AF_INET, SOCK_STREAM, 0);
     if (serverSock < 0) {
         std::cerr << "Error creating socket" << std::endl;
-        return 1;
+        return -1;
     }
 
     sockaddr_in serverAddr;
@@ -42,27 +186,108 @@ int main(int argc, char *argv[]) {
 
     if (bind(serverSock, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
         std::cerr << "Error binding socket" << std::endl;
-        return 1;
+        close(serverSock);
+        return -1;
     }
 
     if (listen(serverSock, 5) < 0) {
         std::cerr << "Error listening on socket" << std::endl;
+        close(serverSock);
+        return -1;
+    }
+    return serverSock;
+}
+
+int main(int argc, char *argv[]) {
+    // An odd argument count means the state directory was given last
+    if (argc < 3 || argc > 7 || argc == 5) {
+        std::cerr << "Usage: " << argv[0] << " <port> <password> [<tls_port> <cert.pem> <key.pem>] [<state_dir>]" << std::endl;
         return 1;
     }
+    std::string stateDir = (argc == 4 || argc == 7) ? argv[argc - 1] : REGISTRY_DEFAULT_DIR;
+
+    int port = std::atoi(argv[1]);
+    if (!authInit(argv[2]))
+        return 1;
+
+    int serverSock = createListener(port);
+    if (serverSock < 0)
+        return 1;
 
     std::vector<pollfd> fds(1);
     fds[0].fd = serverSock;
     fds[0].events = POLLIN;
 
-    std::map<int, Client> clients;
+    // Optional second listener: TLS handshake in-process, records in the kernel
+    int tlsSock = -1;
+    if (argc >= 6) {
+        if (!tlsInit(argv[4], argv[5]))
+            return 1;
+        tlsSock = createListener(std::atoi(argv[3]));
+        if (tlsSock < 0)
+            return 1;
+        pollfd tlsPollFd;
+        tlsPollFd.fd = tlsSock;
+        tlsPollFd.events = POLLIN;
+        tlsPollFd.revents = 0;
+        fds.push_back(tlsPollFd);
+    }
+
+    // Finished PASS/OPER checks wake the loop through this pipe
+    const size_t authIndex = fds.size();
+    pollfd authPollFd;
+    authPollFd.fd = authWakeFd();
+    authPollFd.events = POLLIN;
+    authPollFd.revents = 0;
+    fds.push_back(authPollFd);
+    const size_t listenerCount = fds.size();
+
+    traceInstallSignalHandler();
+
+    // Restore persistent channels before the first client can join one
+    if (!registryOpen(stateDir))
+        return 1;
+
+    // Pins the reactor, so it has to come after the helper threads started
+    if (!lowLatencyInit())
+        return 1;
 
     while (true) {
-        int activity = poll(&fds[0], fds.size(), -1);
-        if (activity < 0) {
+        // Ask for POLLOUT only while a client has queued output, and stop
+        // reading from clients parked on an authentication check
+        for (size_t i = listenerCount; i < fds.size(); i++) {
+            std::map<int, Client>::iterator it = clients.find(fds[i].fd);
+            if (it != clients.end()) {
+                fds[i].events = it->second.authPending ? 0 : POLLIN;
+                if (!it->second.outBuffer.empty())
+                    fds[i].events |= POLLOUT;
+            }
+        }
+
+        // Don't block while a LIST/WHO still has output it can produce
+        int activity = lowLatencyPoll(fds, resumeQueries() ? 0 : 1000);
+        if (activity < 0 && errno != EINTR) {
             std::cerr << "Poll error" << std::endl;
             break;
         }
 
+        if (traceDumpRequested()) {
+            std::string path = traceDump();
+            std::cout << (path.empty() ? "Trace dump failed" : "Trace written to " + path) << std::endl;
+        }
+        if (activity < 0) {
+            continue;
+        }
+
+        if (fds[authIndex].revents & POLLIN) {
+            std::vector<int> resumed;
+            authCollect(resumed);
+            for (size_t r = 0; r < resumed.size(); r++) {
+                processLines(resumed[r], 0);
+                traceEnd();
+            }
+        }
+
         if (fds[0].revents & POLLIN) {
             int clientSock = accept(serverSock, NULL, NULL);
             if (clientSock < 0) {
@@ -70,109 +295,116 @@ int main(int argc, char *argv[]) {
                 continue;
             }
 
+            if (!acceptingConnections()) {
+                send(clientSock, "ERROR :Server is busy, try again later\r\n", 40, MSG_DONTWAIT | MSG_NOSIGNAL);
+                close(clientSock);
+                continue;
+            }
+
+            setNoDelay(clientSock);
             pollfd newPollFd;
             newPollFd.fd = clientSock;
             newPollFd.events = POLLIN;
+            newPollFd.revents = 0;
             fds.push_back(newPollFd);
 
             clients[clientSock] = Client();
             clients[clientSock].fd = clientSock;
+            clients[clientSock].hostname = peerAddress(clientSock);
+            lowLatencyPrepareClient(clientSock);
+            captureConnect(clientSock);
 
-            send(clientSock, "Connect using PASS [password]:\n", 31, 0);
+            sendMessage(clientSock, "Connect using PASS [password]:\n");
         }
 
-        for (size_t i = 1; i < fds.size(); i++) {
-            if (fds[i].revents & POLLIN) {
-                char buffer[BUFFER_SIZE];
-                int bytesRead = recv(fds[i].fd, buffer, BUFFER_SIZE - 1, 0);
-                if (bytesRead <= 0) {
+        if (tlsSock >= 0 && (fds[1].revents & POLLIN)) {
+            int clientSock = accept(tlsSock, NULL, NULL);
+            if (clientSock >= 0 && acceptingConnections() && tlsStart(clientSock)) {
+                // Set before the handshake, so it covers the offloaded socket too
+                setNoDelay(clientSock);
+                pollfd newPollFd;
+                newPollFd.fd = clientSock;
+                newPollFd.events = POLLIN;
+                newPollFd.revents = 0;
+                fds.push_back(newPollFd);
+            } else if (clientSock >= 0) {
+                close(clientSock);
+            }
+        }
+
+        for (size_t i = listenerCount; i < fds.size(); i++) {
+            if (tlsIsPending(fds[i].fd)) {
+                if (!fds[i].revents)
+                    continue;
+                int status = tlsContinue(fds[i].fd, fds[i].events);
+                if (status < 0) {
                     close(fds[i].fd);
-                    clients.erase(fds[i].fd);
                     fds.erase(fds.begin() + i);
                     i--;
+                } else if (status > 0) {
+                    clients[fds[i].fd] = Client();
+                    clients[fds[i].fd].fd = fds[i].fd;
+                    clients[fds[i].fd].hostname = peerAddress(fds[i].fd);
+                    lowLatencyPrepareClient(fds[i].fd);
+                    captureConnect(fds[i].fd);
+                    sendMessage(fds[i].fd, "Connect using PASS [password]:\n");
+                }
+                continue;
+            }
+
+            if (fds[i].revents & POLLOUT) {
+                flushClient(fds[i].fd);
+            }
+
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                char buffer[BUFFER_SIZE];
+                int bytesRead = recv(fds[i].fd, buffer, BUFFER_SIZE, 0);
+                if (bytesRead <= 0) {
+                    disconnectClient(fds, i);
+                    i--;
                     continue;
                 }
 
-                buffer[bytesRead] = '\0';
-                clients[fds[i].fd].buffer += buffer;
-
-                size_t pos;
-                while ((pos = clients[fds[i].fd].buffer.find('\n')) != std::string::npos) {
-                    std::string message = clients[fds[i].fd].buffer.substr(0, pos);
-                    message = trim(message);
-                    clients[fds[i].fd].buffer.erase(0, pos + 1);
-
-                    if (clients[fds[i].fd].authenticated)
-                    {
-                        processMessage(message, fds[i].fd);
-                        continue;
-                    }
-
-                    if (message.substr(0, 3) == "CAP") {
-                        if (message.find("LS") != std::string::npos) {
-                            send(fds[i].fd, "CAP * LS\r\n", 10, 0); // No capabilities
-                        } else if (message.find("REQ") != std::string::npos) {
-                            // Handle capability requests as needed
-                        } else if (message.find("END") != std::string::npos) {
-                            send(fds[i].fd, "CAP * ACK\r\n", 11, 0);
-                        }
-                        continue;
-                    }
-
-                    if (!clients[fds[i].fd].passwordVerified) {
-                        if (message.substr(0, 4) == "PASS") {
-                            std::string clientPassword = message.substr(5);
-                            std::cout << "Received pass: '" << clientPassword << "'" << std::endl; // Debugging output
-                            if (clientPassword == password) {
-                                clients[fds[i].fd].passwordVerified = true;
-                                send(fds[i].fd, "Authentication successful.\r\n", 28, 0);
-                            } else {
-                                send(fds[i].fd, "464 :Password incorrect\r\n", 25, 0);
-                                continue;
-                            }
-                        }
-                    }
-
-                    if (clients[fds[i].fd].passwordVerified) {
-                        if (message.substr(0, 4) == "NICK") {
-                            handleNick(fds[i].fd, message.substr(5));
-                            clients[fds[i].fd].nickname = message.substr(5);
-                            clients[fds[i].fd].nickReceived = true;
-                        }
-
-                        if (message.substr(0, 4) == "USER") {
-                            // Parse USER command
-                            std::istringstream iss(message.substr(5));
-                            std::string username, hostname, servername, realname;
-                            iss >> username >> hostname >> servername;
-                            std::getline(iss, realname);
-                            realname = trim(realname);
-
-                            if (username.empty() || realname.empty()) {
-                                send(fds[i].fd, "461 USER :Not enough parameters\r\n", 35, 0);
-                                continue;
-                            }
-
-                            clients[fds[i].fd].username = username;
-                            clients[fds[i].fd].hostname = hostname;
-                            clients[fds[i].fd].servername = servername;
-                            clients[fds[i].fd].realname = realname;
-                            clients[fds[i].fd].userReceived = true;
-                        }
-
-                        // After both NICK and USER, authenticate the user
-                        if (clients[fds[i].fd].nickReceived && clients[fds[i].fd].userReceived) {
-                            clients[fds[i].fd].authenticated = true;
-
-                            std::string welcomeMsg = std::string(":") + "irc.localhost" + " 001 " + clients[fds[i].fd].nickname +
-                                                    " :Welcome to the IRC Network, " + clients[fds[i].fd].nickname + "\r\n";
-                            send(fds[i].fd, welcomeMsg.c_str(), welcomeMsg.length(), 0);
-                            std::cout << "Received msg: '" << message << "'" << std::endl; // Debugging output
-                        }
-                    }
+                uint64_t recvTime = traceEnabled() ? traceClock() : 0;
+                clients[fds[i].fd].buffer.append(buffer, bytesRead);
+
+                // Drop the rest of a line that already overflowed MAX_LINE_LENGTH
+                if (clients[fds[i].fd].discardLine) {
+                    size_t end = clients[fds[i].fd].buffer.find('\n');
+                    clients[fds[i].fd].buffer.erase(0, end == std::string::npos ? std::string::npos : end + 1);
+                    clients[fds[i].fd].discardLine = (end == std::string::npos);
+                }
+
+                processLines(fds[i].fd, recvTime);
+                traceEnd();
+
+                // Complete lines can only be left over while the client is parked
+                if (clients[fds[i].fd].buffer.length() >= MAX_LINE_LENGTH && clients[fds[i].fd].buffer.find('\n') == std::string::npos) {
+                    std::string().swap(clients[fds[i].fd].buffer);
+                    clients[fds[i].fd].discardLine = true;
+                    sendMessage(fds[i].fd, ":localhost 417 * :Input line was too long\r\n");
                 }
             }
         }
+
+        updateMemoryUsage(false);
+        enforceMemoryBudget();
+        registryMaybeCompact();
+
+        for (size_t i = listenerCount; i < fds.size(); i++) {
+            if (tlsHandshakeExpired(fds[i].fd)) {
+                tlsDrop(fds[i].fd);
+                close(fds[i].fd);
+                fds.erase(fds.begin() + i);
+                i--;
+                continue;
+            }
+            std::map<int, Client>::iterator it = clients.find(fds[i].fd);
+            if (it != clients.end() && !it->second.quitReason.empty()) {
+                disconnectClient(fds, i);
+                i--;
+            }
+        }
     }
 
     for (size_t i = 0; i < fds.size(); i++) {
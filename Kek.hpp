@@ -7,6 +7,10 @@
 #include <sstream>
 #include <iostream>
 
+// Stable handle into the global ChannelTable (see Channel.hpp)
+typedef int ChannelId;
+#define NO_CHANNEL -1
+
 class Client {
 public:
     int fd;
@@ -15,14 +19,23 @@ public:
     std::string hostname;
     std::string servername;
     std::string realname;
-    std::vector<std::string> channels;
+    std::vector<ChannelId> channels;
+    std::vector<ChannelId> invitedTo;   // channels whose invitedUsers hold this client
+    std::vector<ChannelId> banCachedIn; // channels whose banCache holds this client
     bool authenticated;
     std::string buffer;
+    std::string outBuffer;
+    std::string quitReason;
+    bool discardLine;
     bool nickReceived;
     bool userReceived;
     bool passwordVerified;
+    bool authPending;               // a PASS/OPER check is running, input is parked
+    unsigned long authTicket;       // identifies that check when its result arrives
+    unsigned long maskGeneration;   // bumped whenever nick!user@host changes
 
-    Client() : fd(-1), authenticated(false), nickReceived(false), userReceived(false), passwordVerified(false) {}
+    Client() : fd(-1), authenticated(false), discardLine(false), nickReceived(false), userReceived(false), passwordVerified(false),
+               authPending(false), authTicket(0), maskGeneration(0) {}
 };
 
 #endif // KEK_HPP
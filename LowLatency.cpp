@@ -0,0 +1,131 @@
+#include "LowLatency.hpp"
+#include "Channel.hpp"
+
+#ifdef IRC_LOW_LATENCY
+
+#include "Recorder.hpp"
+#include <cstring>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static uint64_t spinBudget = LOW_LATENCY_SPIN_MIN_US * 1000ULL;
+static bool spinning = false;
+static cpu_set_t helperCpus;        // where threads started after pinning may run
+static bool reactorPinned = false;
+
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+__attribute__((noinline))
+static void prefaultStack() {
+    volatile char stack[LOW_LATENCY_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+// Call once every helper thread is running, so they are not confined to
+// the reactor's CPU as well
+bool lowLatencyInit() {
+    // Keep freed memory in the heap instead of handing it back to the kernel,
+    // then touch a large block once so later allocations find it resident
+    mallopt(M_TRIM_THRESHOLD, LOW_LATENCY_HEAP_PREFAULT * 2);
+    mallopt(M_MMAP_THRESHOLD, LOW_LATENCY_HEAP_PREFAULT);
+    char *heap = static_cast<char*>(malloc(LOW_LATENCY_HEAP_PREFAULT - 4096));
+    if (heap) {
+        std::memset(heap, 0, LOW_LATENCY_HEAP_PREFAULT - 4096);
+        free(heap);
+    }
+    prefaultStack();
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        std::cerr << "Low-latency: mlockall failed, pages may still be swapped out" << std::endl;
+
+    // Helper threads get every other CPU the process may use
+    if (sched_getaffinity(0, sizeof(helperCpus), &helperCpus) < 0)
+        CPU_ZERO(&helperCpus);
+    if (CPU_COUNT(&helperCpus) > 1)
+        CPU_CLR(LOW_LATENCY_CPU, &helperCpus);
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(LOW_LATENCY_CPU, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+        std::cerr << "Low-latency: cannot pin the reactor to CPU " << LOW_LATENCY_CPU << std::endl;
+        return false;
+    }
+    reactorPinned = true;
+
+    spinning = sysconf(_SC_NPROCESSORS_ONLN) >= 2;
+    std::cout << "Low-latency mode, reactor pinned to CPU " << LOW_LATENCY_CPU << std::endl;
+    if (!spinning)
+        std::cerr << "Low-latency: only one CPU online, poll() will block instead of spinning" << std::endl;
+    return true;
+}
+
+// TCP_NODELAY is set on every accepted socket, in any build
+void lowLatencyPrepareClient(int clientSock) {
+#ifdef SO_BUSY_POLL
+    // Raising this above net.core.busy_read needs CAP_NET_ADMIN; without it
+    // the socket keeps interrupt-driven receives
+    int busyPoll = LOW_LATENCY_BUSY_POLL_US;
+    setsockopt(clientSock, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof(busyPoll));
+#endif
+
+    Client& client = clients[clientSock];
+    client.buffer.reserve(LOW_LATENCY_BUFFER_RESERVE);
+    client.outBuffer.reserve(LOW_LATENCY_BUFFER_RESERVE);
+}
+
+// Threads created after lowLatencyInit() inherit the reactor's CPU; they
+// call this first so they do not compete with the event loop
+void lowLatencyReleaseThread() {
+    if (reactorPinned && CPU_COUNT(&helperCpus) > 0)
+        pthread_setaffinity_np(pthread_self(), sizeof(helperCpus), &helperCpus);
+}
+
+// Spins on a non-blocking poll() before falling back to the blocking one.
+// The spin budget doubles whenever spinning caught an event and halves
+// whenever it had to block, so an idle server stops burning the CPU.
+int lowLatencyPoll(std::vector<pollfd>& fds, int timeout) {
+    if (timeout != 0 && spinning) {
+        uint64_t deadline = traceClock() + spinBudget;
+        do {
+            int ready = poll(&fds[0], fds.size(), 0);
+            if (ready != 0) {
+                if (spinBudget < LOW_LATENCY_SPIN_MAX_US * 1000ULL)
+                    spinBudget *= 2;
+                return ready;
+            }
+            cpuRelax();
+        } while (traceClock() < deadline);
+
+        if (spinBudget > LOW_LATENCY_SPIN_MIN_US * 1000ULL)
+            spinBudget /= 2;
+    }
+    return poll(&fds[0], fds.size(), timeout);
+}
+
+#else
+
+bool lowLatencyInit() {
+    return true;
+}
+
+void lowLatencyPrepareClient(int) {
+}
+
+void lowLatencyReleaseThread() {
+}
+
+int lowLatencyPoll(std::vector<pollfd>& fds, int timeout) {
+    return poll(&fds[0], fds.size(), timeout);
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef LOW_LATENCY_HPP
+#define LOW_LATENCY_HPP
+
+#include <vector>
+#include <poll.h>
+
+// Low-latency mode: the reactor is pinned to one CPU, spins on a zero
+// timeout poll() before blocking, and busy-polls client sockets; memory is
+// locked and pre-faulted up front so the hot path takes no page faults.
+// Only compiled in with `make LOWLATENCY=1`; otherwise these are no-ops
+// and lowLatencyPoll() is a plain poll(). With fewer than two online CPUs
+// spinning only steals time from the clients and the helper threads, so
+// there lowLatencyPoll() always blocks.
+
+#ifndef LOW_LATENCY_CPU
+# define LOW_LATENCY_CPU 0              // CPU the reactor is pinned to
+#endif
+#define LOW_LATENCY_SPIN_MIN_US 20      // adaptive spin budget before blocking
+#define LOW_LATENCY_SPIN_MAX_US 2000
+#define LOW_LATENCY_BUSY_POLL_US 50     // SO_BUSY_POLL on client sockets
+#define LOW_LATENCY_HEAP_PREFAULT (64 * 1024 * 1024)
+#define LOW_LATENCY_STACK_PREFAULT (512 * 1024)
+#define LOW_LATENCY_BUFFER_RESERVE 4096 // client input/output capacity reserved on accept
+
+bool lowLatencyInit();
+void lowLatencyPrepareClient(int clientSock);
+void lowLatencyReleaseThread();
+int lowLatencyPoll(std::vector<pollfd>& fds, int timeout);
+
+#endif // LOW_LATENCY_HPP
@@ -0,0 +1,281 @@
+#include "Mask.hpp"
+#include "Memory.hpp"
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+static bool segmentMatchesAt(const std::string& segment, const char *text) {
+    for (size_t i = 0; i < segment.length(); ++i) {
+        if (segment[i] != '?' && segment[i] != text[i])
+            return false;
+    }
+    return true;
+}
+
+// Leftmost occurrence of segment in text[from, end). The SSE2 path compares
+// the segment's first and last bytes against 16 candidate positions at once
+// and only verifies positions where both agree.
+static size_t findSegment(const std::string& segment, const std::string& text, size_t from, size_t end) {
+    size_t len = segment.length();
+    if (len == 0)
+        return from;
+    if (from + len > end)
+        return std::string::npos;
+
+    const char *data = text.data();
+    size_t i = from;
+#ifdef __SSE2__
+    char first = segment[0];
+    char last = segment[len - 1];
+    if (first != '?' && last != '?') {
+        const __m128i firstBytes = _mm_set1_epi8(first);
+        const __m128i lastBytes = _mm_set1_epi8(last);
+        for (; i + 16 + len - 1 <= end; i += 16) {
+            __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + len - 1));
+            unsigned int candidates = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, firstBytes),
+                                                                      _mm_cmpeq_epi8(tail, lastBytes)));
+            while (candidates) {
+                unsigned int bit = __builtin_ctz(candidates);
+                if (segmentMatchesAt(segment, data + i + bit))
+                    return i + bit;
+                candidates &= candidates - 1;
+            }
+        }
+    }
+#endif
+    for (; i + len <= end; ++i) {
+        if (segmentMatchesAt(segment, data + i))
+            return i;
+    }
+    return std::string::npos;
+}
+
+CompiledMask compileMask(const std::string& mask) {
+    CompiledMask compiled;
+    std::string folded = ircCasefold(mask);
+    compiled.anchoredStart = folded.empty() || folded[0] != '*';
+    compiled.anchoredEnd = folded.empty() || folded[folded.length() - 1] != '*';
+
+    size_t start = 0;
+    while (start <= folded.length()) {
+        size_t star = folded.find('*', start);
+        if (star == std::string::npos)
+            star = folded.length();
+        if (star > start || (compiled.anchoredStart && compiled.anchoredEnd)) {
+            compiled.segments.push_back(folded.substr(start, star - start));
+            compiled.minLength += star - start;
+        }
+        start = star + 1;
+    }
+    return compiled;
+}
+
+bool matchMask(const CompiledMask& mask, const std::string& foldedSubject) {
+    const std::vector<std::string>& segments = mask.segments;
+    if (foldedSubject.length() < mask.minLength)
+        return false;
+    if (segments.empty())
+        return true;    // only stars
+    if (mask.anchoredStart && mask.anchoredEnd && segments.size() == 1)
+        return foldedSubject.length() == segments[0].length() && segmentMatchesAt(segments[0], foldedSubject.data());
+
+    size_t first = 0;
+    size_t last = segments.size();
+    size_t pos = 0;
+    size_t end = foldedSubject.length();
+
+    if (mask.anchoredStart) {
+        if (!segmentMatchesAt(segments[0], foldedSubject.data()))
+            return false;
+        pos = segments[0].length();
+        first = 1;
+    }
+    if (mask.anchoredEnd && last > first) {
+        const std::string& tail = segments[last - 1];
+        if (end - pos < tail.length() || !segmentMatchesAt(tail, foldedSubject.data() + end - tail.length()))
+            return false;
+        end -= tail.length();
+        --last;
+    }
+    for (size_t i = first; i < last; ++i) {
+        size_t found = findSegment(segments[i], foldedSubject, pos, end);
+        if (found == std::string::npos)
+            return false;
+        pos = found + segments[i].length();
+    }
+    return true;
+}
+
+bool matchMask(const std::string& mask, const std::string& subject) {
+    return matchMask(compileMask(mask), ircCasefold(subject));
+}
+
+std::string normalizeHostmask(const std::string& mask) {
+    bool hasBang = mask.find('!') != std::string::npos;
+    bool hasAt = mask.find('@') != std::string::npos;
+    if (!hasBang && !hasAt)
+        return mask + "!*@*";
+    if (!hasBang)
+        return "*!" + mask;
+    if (!hasAt)
+        return mask + "@*";
+    return mask;
+}
+
+// The root is only allocated by the first insert, so the empty lists every
+// channel starts with cost no allocation to create or copy
+MaskTrie::MaskTrie() {}
+
+void MaskTrie::insert(const std::string& literal) {
+    if (_nodes.empty())
+        _nodes.push_back(Node());
+    int node = 0;
+    for (size_t i = 0; i < literal.length(); ++i) {
+        std::map<char, int>::iterator it = _nodes[node].next.find(literal[i]);
+        if (it == _nodes[node].next.end()) {
+            _nodes.push_back(Node());
+            int child = static_cast<int>(_nodes.size()) - 1;
+            _nodes[node].next[literal[i]] = child;
+            node = child;
+        } else {
+            node = it->second;
+        }
+    }
+    _nodes[node].terminal = true;
+}
+
+bool MaskTrie::matchesStartOf(const std::string& subject) const {
+    if (_nodes.empty())
+        return false;
+    int node = 0;
+    for (size_t i = 0; i < subject.length(); ++i) {
+        if (_nodes[node].terminal)
+            return true;
+        std::map<char, int>::const_iterator it = _nodes[node].next.find(subject[i]);
+        if (it == _nodes[node].next.end())
+            return false;
+        node = it->second;
+    }
+    return _nodes[node].terminal;
+}
+
+void MaskTrie::clear() {
+    _nodes.clear();
+}
+
+size_t MaskTrie::bytes() const {
+    size_t total = _nodes.capacity() * sizeof(Node);
+    for (std::vector<Node>::const_iterator it = _nodes.begin(); it != _nodes.end(); ++it)
+        total += it->next.size() * (TREE_NODE_BYTES + sizeof(std::pair<const char, int>));
+    return total;
+}
+
+static bool isLiteral(const std::string& str) {
+    return str.find_first_of("*?") == std::string::npos;
+}
+
+static bool startsWith(const std::string& str, const std::string& prefix) {
+    return str.compare(0, prefix.length(), prefix) == 0;
+}
+
+static bool endsWith(const std::string& str, const std::string& suffix) {
+    return str.length() >= suffix.length() && str.compare(str.length() - suffix.length(), suffix.length(), suffix) == 0;
+}
+
+static std::string reversed(const std::string& str) {
+    return std::string(str.rbegin(), str.rend());
+}
+
+// Subjects always have the nick!user@host shape, which lets common masks
+// drop their trailing "*@*" / leading "*!*@*" and become plain literals.
+void MaskList::compile(const std::string& mask) {
+    if (isLiteral(mask)) {
+        _exact.insert(mask);
+    } else if (startsWith(mask, "*!*@") && isLiteral(mask.substr(4))) {
+        _hosts.insert(mask.substr(4));
+    } else if (startsWith(mask, "*!*@*") && isLiteral(mask.substr(5)) && mask.find('@', 5) == std::string::npos) {
+        _suffixes.insert(reversed(mask.substr(5)));
+    } else if (mask[0] == '*' && isLiteral(mask.substr(1))) {
+        _suffixes.insert(reversed(mask.substr(1)));
+    } else if (endsWith(mask, "!*@*") && isLiteral(mask.substr(0, mask.length() - 3))) {
+        _prefixes.insert(mask.substr(0, mask.length() - 3));
+    } else if (endsWith(mask, "@*") && isLiteral(mask.substr(0, mask.length() - 1))) {
+        _prefixes.insert(mask.substr(0, mask.length() - 1));
+    } else if (mask[mask.length() - 1] == '*' && isLiteral(mask.substr(0, mask.length() - 1))) {
+        _prefixes.insert(mask.substr(0, mask.length() - 1));
+    } else {
+        _globs.push_back(compileMask(mask));
+    }
+}
+
+void MaskList::rebuild() {
+    _exact.clear();
+    _hosts.clear();
+    _prefixes.clear();
+    _suffixes.clear();
+    _globs.clear();
+    for (std::vector<std::string>::const_iterator it = _entries.begin(); it != _entries.end(); ++it) {
+        compile(ircCasefold(*it));
+    }
+}
+
+bool MaskList::add(const std::string& mask) {
+    for (std::vector<std::string>::const_iterator it = _entries.begin(); it != _entries.end(); ++it) {
+        if (ircCasefold(*it) == ircCasefold(mask))
+            return false;
+    }
+    _entries.push_back(mask);
+    compile(ircCasefold(mask));
+    return true;
+}
+
+bool MaskList::remove(const std::string& mask) {
+    for (std::vector<std::string>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+        if (ircCasefold(*it) == ircCasefold(mask)) {
+            _entries.erase(it);
+            rebuild();
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t stringSetBytes(const std::set<std::string>& strings) {
+    size_t total = strings.size() * (TREE_NODE_BYTES + sizeof(std::string));
+    for (std::set<std::string>::const_iterator it = strings.begin(); it != strings.end(); ++it)
+        total += it->capacity();
+    return total;
+}
+
+size_t MaskList::bytes() const {
+    size_t total = _entries.capacity() * sizeof(std::string) + _globs.capacity() * sizeof(CompiledMask)
+                 + stringSetBytes(_exact) + stringSetBytes(_hosts) + _prefixes.bytes() + _suffixes.bytes();
+    for (std::vector<std::string>::const_iterator it = _entries.begin(); it != _entries.end(); ++it)
+        total += it->capacity();
+    for (std::vector<CompiledMask>::const_iterator it = _globs.begin(); it != _globs.end(); ++it) {
+        total += it->segments.capacity() * sizeof(std::string);
+        for (std::vector<std::string>::const_iterator segment = it->segments.begin(); segment != it->segments.end(); ++segment)
+            total += segment->capacity();
+    }
+    return total;
+}
+
+bool MaskList::matches(const std::string& subject) const {
+    if (_entries.empty())
+        return false;
+    if (_exact.count(subject))
+        return true;
+
+    size_t at = subject.rfind('@');
+    if (at != std::string::npos && _hosts.count(subject.substr(at + 1)))
+        return true;
+    if (_prefixes.matchesStartOf(subject) || _suffixes.matchesStartOf(reversed(subject)))
+        return true;
+
+    for (std::vector<CompiledMask>::const_iterator it = _globs.begin(); it != _globs.end(); ++it) {
+        if (matchMask(*it, subject))
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,76 @@
+#ifndef MASK_HPP
+#define MASK_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#define MAX_LIST_ENTRIES 50     // per +b/+e/+I list
+
+std::string ircCasefold(const std::string& str);
+
+// A '*'/'?' glob split on '*' into fixed-length segments. Masks and
+// subjects are compared casefolded.
+struct CompiledMask {
+    std::vector<std::string> segments;
+    bool anchoredStart;
+    bool anchoredEnd;
+    size_t minLength;
+
+    CompiledMask() : anchoredStart(true), anchoredEnd(true), minLength(0) {}
+};
+
+CompiledMask compileMask(const std::string& mask);
+bool matchMask(const CompiledMask& mask, const std::string& foldedSubject);
+bool matchMask(const std::string& mask, const std::string& subject);
+std::string normalizeHostmask(const std::string& mask);
+
+// Byte trie answering "does any stored literal start the given string"
+class MaskTrie {
+public:
+    MaskTrie();
+
+    void insert(const std::string& literal);
+    bool matchesStartOf(const std::string& subject) const;
+    void clear();
+    size_t bytes() const;
+
+private:
+    struct Node {
+        std::map<char, int> next;
+        bool terminal;
+
+        Node() : terminal(false) {}
+    };
+
+    std::vector<Node> _nodes;
+};
+
+// A +b/+e/+I list. Masks are sorted into classes when added so a
+// nick!user@host check costs one lookup per class instead of one glob
+// per mask: exact masks and *!*@host masks are looked up in sets, literal
+// prefixes (nick!*@*) and suffixes (*!*@*.domain) are tries, and only
+// what remains goes through the glob matcher.
+class MaskList {
+public:
+    bool add(const std::string& mask);
+    bool remove(const std::string& mask);
+    bool matches(const std::string& foldedSubject) const;
+    const std::vector<std::string>& entries() const { return _entries; }
+    size_t size() const { return _entries.size(); }
+    size_t bytes() const;
+
+private:
+    std::vector<std::string> _entries;
+    std::set<std::string> _exact;
+    std::set<std::string> _hosts;
+    MaskTrie _prefixes;
+    MaskTrie _suffixes;
+    std::vector<CompiledMask> _globs;
+
+    void compile(const std::string& foldedMask);
+    void rebuild();
+};
+
+#endif // MASK_HPP
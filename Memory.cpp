@@ -0,0 +1,109 @@
+#include "Memory.hpp"
+#include "Auth.hpp"
+#include "Capture.hpp"
+#include "Channel.hpp"
+#include "Monitor.hpp"
+#include "Query.hpp"
+#include "Registry.hpp"
+#include <algorithm>
+#include <ctime>
+#include <sstream>
+
+MemoryUsage memoryUsage;
+
+static time_t lastUpdate = 0;
+static bool freshSample = false;   // taken since enforceMemoryBudget() last shed clients
+
+static size_t clientFootprint(const Client& client) {
+    return sizeof(Client) + (client.channels.capacity() + client.invitedTo.capacity() + client.banCachedIn.capacity()) * sizeof(ChannelId)
+         + client.nickname.capacity() + client.username.capacity() + client.hostname.capacity()
+         + client.servername.capacity() + client.realname.capacity() + client.quitReason.capacity();
+}
+
+// Walks all server state; rate-limited to once a second unless forced since
+// per-client caps already bound how far usage can move in between. Clients
+// already marked for disconnection are left out, their memory is about to
+// be released.
+void updateMemoryUsage(bool force) {
+    time_t now = time(NULL);
+    if (!force && now == lastUpdate)
+        return;
+    lastUpdate = now;
+    freshSample = true;
+
+    MemoryUsage usage;
+    for (std::map<int, Client>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (!it->second.quitReason.empty())
+            continue;
+        usage.clients += clientFootprint(it->second);
+        usage.inputBuffers += it->second.buffer.capacity();
+        usage.outputQueues += it->second.outBuffer.capacity();
+    }
+    usage.channels = channels.indexBytes() + (channels.slotCount() - channels.size()) * sizeof(Channel);
+    for (ChannelId id = 0; id < channels.slotCount(); ++id) {
+        if (!channels.isActive(id))
+            continue;
+        const Channel& channel = channels[id];
+        usage.channels += sizeof(Channel) + channel.name.capacity()
+                        + (channel.clients.capacity() + channel.operators.capacity() + channel.invitedUsers.capacity()) * sizeof(int)
+                        + channel._mode.capacity();
+        usage.topics += channel.topic.capacity() + channel.key.capacity();
+        usage.masks += channel.bans.bytes() + channel.exceptions.bytes() + channel.inviteExceptions.bytes()
+                     + channel.banCache.size() * (TREE_NODE_BYTES + sizeof(std::pair<const int, BanCacheEntry>));
+    }
+    usage.indexes = queryBytes() + monitorBytes();
+    usage.pending = authQueueBytes() + registryQueueBytes() + captureBytes();
+    usage.clientCount = clients.size();
+    usage.channelCount = channels.size();
+    memoryUsage = usage;
+}
+
+bool acceptingConnections() {
+    return memoryUsage.total() < MEMORY_SOFT_LIMIT;
+}
+
+// Only acts on a sample taken after the previous round of shedding, so a
+// stale total does not keep picking more victims on every loop iteration
+void enforceMemoryBudget() {
+    if (!freshSample)
+        return;
+    freshSample = false;
+
+    size_t total = memoryUsage.total();
+    while (total > MEMORY_HARD_LIMIT) {
+        Client* largest = NULL;
+        size_t largestSize = 0;
+        for (std::map<int, Client>::iterator it = clients.begin(); it != clients.end(); ++it) {
+            if (!it->second.quitReason.empty())
+                continue;
+            size_t size = clientFootprint(it->second) + it->second.buffer.capacity() + it->second.outBuffer.capacity();
+            if (size > largestSize) {
+                largest = &it->second;
+                largestSize = size;
+            }
+        }
+        if (!largest)
+            break;
+        largest->quitReason = "Server memory budget exceeded";
+        total -= std::min(total, largestSize);
+    }
+}
+
+void sendMemoryStats(int clientSockfd) {
+    updateMemoryUsage(true);
+
+    const std::string prefix = ":localhost 249 " + clients[clientSockfd].nickname + " z :";
+    std::ostringstream oss;
+    oss << prefix << "Clients " << memoryUsage.clientCount << " (" << memoryUsage.clients << " bytes)\r\n"
+        << prefix << "Channels " << memoryUsage.channelCount << " (" << memoryUsage.channels << " bytes)\r\n"
+        << prefix << "Topics and keys " << memoryUsage.topics << " bytes\r\n"
+        << prefix << "Channel lists " << memoryUsage.masks << " bytes\r\n"
+        << prefix << "Indexes " << memoryUsage.indexes << " bytes\r\n"
+        << prefix << "Pending work " << memoryUsage.pending << " bytes\r\n"
+        << prefix << "Input buffers " << memoryUsage.inputBuffers << " bytes\r\n"
+        << prefix << "Output queues " << memoryUsage.outputQueues << " bytes\r\n"
+        << prefix << "Total " << memoryUsage.total() << " bytes (soft " << MEMORY_SOFT_LIMIT
+        << ", hard " << MEMORY_HARD_LIMIT << ")\r\n"
+        << ":localhost 219 " << clients[clientSockfd].nickname << " z :End of STATS report\r\n";
+    sendMessage(clientSockfd, oss.str());
+}
@@ -0,0 +1,50 @@
+#ifndef MEMORY_HPP
+#define MEMORY_HPP
+
+#include <cstddef>
+
+// Per-client and per-channel size caps
+#define MAX_LINE_LENGTH 512                 // RFC 1459 line, CRLF included
+#define MAX_SENDQ (64 * 1024)               // queued output before a client is dropped
+#define MAX_CHANNEL_NAME_LENGTH 50
+#define MAX_TOPIC_LENGTH 390
+#define MAX_KEY_LENGTH 23
+#define MAX_CHANNELS_PER_CLIENT 20
+
+// Global budget: above the soft limit new connections are refused, above the
+// hard limit the largest clients are disconnected until usage drops below it.
+#ifndef MEMORY_SOFT_LIMIT
+# define MEMORY_SOFT_LIMIT (64UL * 1024 * 1024)
+#endif
+#ifndef MEMORY_HARD_LIMIT
+# define MEMORY_HARD_LIMIT (128UL * 1024 * 1024)
+#endif
+
+// Bookkeeping of one std::map/std::set node (colour, parent, two children)
+#define TREE_NODE_BYTES (4 * sizeof(void*))
+
+struct MemoryUsage {
+    size_t clients;         // Client objects and their identity strings
+    size_t inputBuffers;    // partial lines waiting for a newline
+    size_t outputQueues;    // replies waiting for the socket to drain
+    size_t channels;        // Channel objects, member and invite lists
+    size_t topics;          // topics and keys
+    size_t masks;           // +b/+e/+I lists and cached ban verdicts
+    size_t indexes;         // LIST/WHO/WHOIS and MONITOR indexes, running queries
+    size_t pending;         // auth checks, registry writes, capture partial lines
+    size_t clientCount;
+    size_t channelCount;
+
+    MemoryUsage() : clients(0), inputBuffers(0), outputQueues(0), channels(0), topics(0), masks(0), indexes(0), pending(0),
+                    clientCount(0), channelCount(0) {}
+    size_t total() const { return clients + inputBuffers + outputQueues + channels + topics + masks + indexes + pending; }
+};
+
+extern MemoryUsage memoryUsage;
+
+void updateMemoryUsage(bool force);
+bool acceptingConnections();
+void enforceMemoryBudget();
+void sendMemoryStats(int clientSockfd);
+
+#endif // MEMORY_HPP
@@ -0,0 +1,173 @@
+#include "Monitor.hpp"
+#include "Channel.hpp"
+#include "Memory.hpp"
+#include "Query.hpp"
+#include <sstream>
+
+static std::map<std::string, std::set<int> > watchers;                     // casefolded nick -> watching fds
+static std::map<int, std::map<std::string, std::string> > watchLists;      // fd -> casefolded nick -> nick as given
+
+// Only registered clients count as online
+static int findOnline(const std::string& foldedNick) {
+    int fd = findClientByFoldedNick(foldedNick);
+    if (fd < 0 || !clients[fd].authenticated)
+        return -1;
+    return fd;
+}
+
+static std::string fullMask(int clientSockfd) {
+    const Client& client = clients[clientSockfd];
+    return client.nickname + "!" + client.username + "@" + client.hostname;
+}
+
+// Packs targets into as few "<numeric> <nick> :a,b,c" lines as fit
+static void sendBatched(int clientSockfd, const char *numeric, const std::vector<std::string>& targets) {
+    const std::string prefix = ":localhost " + std::string(numeric) + " " + clients[clientSockfd].nickname + " :";
+    std::string line;
+    for (std::vector<std::string>::const_iterator it = targets.begin(); it != targets.end(); ++it) {
+        if (!line.empty() && line.length() + it->length() + 1 > MONITOR_LINE_TARGETS) {
+            sendMessage(clientSockfd, prefix + line + "\r\n");
+            line.clear();
+        }
+        line += (line.empty() ? "" : ",") + *it;
+    }
+    if (!line.empty())
+        sendMessage(clientSockfd, prefix + line + "\r\n");
+}
+
+static void sendStatus(int clientSockfd, const std::vector<std::string>& targets) {
+    std::vector<std::string> online, offline;
+    for (std::vector<std::string>::const_iterator it = targets.begin(); it != targets.end(); ++it) {
+        int fd = findOnline(ircCasefold(*it));
+        if (fd >= 0)
+            online.push_back(fullMask(fd));
+        else
+            offline.push_back(*it);
+    }
+    sendBatched(clientSockfd, "730", online);
+    sendBatched(clientSockfd, "731", offline);
+}
+
+static void addTargets(int clientSockfd, const std::string& targetList) {
+    std::map<std::string, std::string>& list = watchLists[clientSockfd];
+    std::vector<std::string> added;
+    std::istringstream iss(targetList);
+    std::string target;
+    while (std::getline(iss, target, ',')) {
+        if (target.empty())
+            continue;
+        std::string folded = ircCasefold(target);
+        if (list.count(folded))
+            continue;
+        if (list.size() >= MAX_MONITOR_ENTRIES) {
+            std::ostringstream oss;
+            oss << ":localhost 734 " << clients[clientSockfd].nickname << " " << MAX_MONITOR_ENTRIES << " "
+                << target << " :Monitor list is full.\r\n";
+            sendMessage(clientSockfd, oss.str());
+            break;
+        }
+        list[folded] = target;
+        watchers[folded].insert(clientSockfd);
+        added.push_back(target);
+    }
+    sendStatus(clientSockfd, added);
+}
+
+static void unwatch(int clientSockfd, const std::string& folded) {
+    std::map<std::string, std::set<int> >::iterator it = watchers.find(folded);
+    if (it == watchers.end())
+        return;
+    it->second.erase(clientSockfd);
+    if (it->second.empty())
+        watchers.erase(it);
+}
+
+static void removeTargets(int clientSockfd, const std::string& targetList) {
+    std::map<int, std::map<std::string, std::string> >::iterator list = watchLists.find(clientSockfd);
+    if (list == watchLists.end())
+        return;
+    std::istringstream iss(targetList);
+    std::string target;
+    while (std::getline(iss, target, ',')) {
+        std::string folded = ircCasefold(target);
+        if (list->second.erase(folded))
+            unwatch(clientSockfd, folded);
+    }
+    if (list->second.empty())
+        watchLists.erase(list);
+}
+
+static std::vector<std::string> listTargets(int clientSockfd) {
+    std::vector<std::string> targets;
+    std::map<int, std::map<std::string, std::string> >::iterator list = watchLists.find(clientSockfd);
+    if (list != watchLists.end()) {
+        for (std::map<std::string, std::string>::iterator it = list->second.begin(); it != list->second.end(); ++it)
+            targets.push_back(it->second);
+    }
+    return targets;
+}
+
+// MONITOR + targets | - targets | C | L | S
+void handleMonitor(int clientSockfd, const std::string& args) {
+    std::istringstream iss(args);
+    std::string action, targets;
+    iss >> action >> targets;
+
+    if (action == "+" && !targets.empty()) {
+        addTargets(clientSockfd, targets);
+    } else if (action == "-" && !targets.empty()) {
+        removeTargets(clientSockfd, targets);
+    } else if (action == "C" || action == "c") {
+        monitorRemoveClient(clientSockfd);
+    } else if (action == "L" || action == "l") {
+        sendBatched(clientSockfd, "732", listTargets(clientSockfd));
+        sendMessage(clientSockfd, ":localhost 733 " + clients[clientSockfd].nickname + " :End of MONITOR list\r\n");
+    } else if (action == "S" || action == "s") {
+        sendStatus(clientSockfd, listTargets(clientSockfd));
+    } else {
+        sendMessage(clientSockfd, ":localhost 461 " + clients[clientSockfd].nickname + " MONITOR :Not enough parameters\r\n");
+    }
+}
+
+static void notifyWatchers(int clientSockfd, const char *numeric, const std::string& target) {
+    std::map<std::string, std::set<int> >::iterator it = watchers.find(ircCasefold(clients[clientSockfd].nickname));
+    if (it == watchers.end())
+        return;
+    for (std::set<int>::iterator watcher = it->second.begin(); watcher != it->second.end(); ++watcher) {
+        sendMessage(*watcher, ":localhost " + std::string(numeric) + " " + clients[*watcher].nickname + " :" + target + "\r\n");
+    }
+}
+
+// Call once the client is registered under its current nick
+void monitorOnline(int clientSockfd) {
+    notifyWatchers(clientSockfd, "730", fullMask(clientSockfd));
+}
+
+// Call while the client still holds the nick that goes away
+void monitorOffline(int clientSockfd) {
+    notifyWatchers(clientSockfd, "731", clients[clientSockfd].nickname);
+}
+
+// Drops the client's own watch list
+void monitorRemoveClient(int clientSockfd) {
+    std::map<int, std::map<std::string, std::string> >::iterator list = watchLists.find(clientSockfd);
+    if (list == watchLists.end())
+        return;
+    for (std::map<std::string, std::string>::iterator it = list->second.begin(); it != list->second.end(); ++it)
+        unwatch(clientSockfd, it->first);
+    watchLists.erase(list);
+}
+
+// Both indexes, for STATS z
+size_t monitorBytes() {
+    size_t total = watchers.size() * (TREE_NODE_BYTES + sizeof(std::pair<const std::string, std::set<int> >))
+                 + watchLists.size() * (TREE_NODE_BYTES + sizeof(std::pair<const int, std::map<std::string, std::string> >));
+    for (std::map<std::string, std::set<int> >::const_iterator it = watchers.begin(); it != watchers.end(); ++it)
+        total += it->first.capacity() + it->second.size() * (TREE_NODE_BYTES + sizeof(int));
+    for (std::map<int, std::map<std::string, std::string> >::const_iterator list = watchLists.begin(); list != watchLists.end(); ++list) {
+        total += list->second.size() * (TREE_NODE_BYTES + sizeof(std::pair<const std::string, std::string>));
+        for (std::map<std::string, std::string>::const_iterator it = list->second.begin(); it != list->second.end(); ++it)
+            total += it->first.capacity() + it->second.capacity();
+    }
+    return total;
+}
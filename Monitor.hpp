@@ -0,0 +1,20 @@
+#ifndef MONITOR_HPP
+#define MONITOR_HPP
+
+#include <cstddef>
+#include <string>
+
+// IRCv3 MONITOR. Watch lists are indexed both ways: per client for
+// MONITOR L/C, and casefolded nick -> watchers so a nick coming or going
+// only touches the clients that asked about it.
+
+#define MAX_MONITOR_ENTRIES 100     // per client, beyond that MONITOR + gets 734
+#define MONITOR_LINE_TARGETS 400    // bytes of targets packed into one 730-732 reply
+
+void handleMonitor(int clientSockfd, const std::string& args);
+void monitorOnline(int clientSockfd);
+void monitorOffline(int clientSockfd);
+void monitorRemoveClient(int clientSockfd);
+size_t monitorBytes();
+
+#endif // MONITOR_HPP
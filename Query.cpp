@@ -0,0 +1,302 @@
+#include "Query.hpp"
+#include "Memory.hpp"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+
+typedef std::pair<int, ChannelId> SizeKey;
+typedef std::set<SizeKey, std::greater<SizeKey> > SizeIndex;
+
+static SizeIndex channelsBySize;                        // largest channels first
+static std::map<std::string, int> nickIndex;            // casefolded nick -> fd
+static std::set<std::pair<std::string, int> > hostIndex; // casefolded host, fd
+
+struct PendingQuery {
+    enum Kind { LIST, WHO_CHANNEL, WHO_NICK, WHO_HOST };
+
+    Kind kind;
+    std::string mask;
+    std::vector<CompiledMask> names;
+    CompiledMask who;
+    std::string prefix;
+    int minUsers;
+    int maxUsers;
+    bool started;
+    SizeKey lastChannel;
+    std::pair<std::string, int> lastClient;
+    ChannelId channelId;
+    std::string channelName;    // casefolded; ids are reused, so checked on every resume
+    size_t position;
+
+    PendingQuery() : kind(LIST), minUsers(-1), maxUsers(-1), started(false), lastChannel(0, NO_CHANNEL),
+                     lastClient("", -1), channelId(NO_CHANNEL), position(0) {}
+};
+
+static std::map<int, PendingQuery> pendingQueries;
+
+// Literal part of a mask before its first wildcard, usable as an index range
+static std::string maskPrefix(const std::string& mask) {
+    return ircCasefold(mask.substr(0, mask.find_first_of("*?")));
+}
+
+static bool hasPrefix(const std::string& str, const std::string& prefix) {
+    return str.compare(0, prefix.length(), prefix) == 0;
+}
+
+
+// Call after a channel's member list changed, before erasing an emptied channel
+void updateChannelIndex(ChannelId channelId, size_t oldMemberCount) {
+    channelsBySize.erase(SizeKey(static_cast<int>(oldMemberCount), channelId));
+    // Empty channels are only listed while they are registered as persistent
+    if (channels.isActive(channelId) && (!channels[channelId].clients.empty() || channels[channelId].persistent))
+        channelsBySize.insert(SizeKey(static_cast<int>(channels[channelId].clients.size()), channelId));
+}
+
+void indexClient(int clientSockfd) {
+    const Client& client = clients[clientSockfd];
+    if (!client.nickname.empty())
+        nickIndex[ircCasefold(client.nickname)] = clientSockfd;
+    if (!client.hostname.empty())
+        hostIndex.insert(std::make_pair(ircCasefold(client.hostname), clientSockfd));
+}
+
+void unindexClient(int clientSockfd) {
+    const Client& client = clients[clientSockfd];
+    std::map<std::string, int>::iterator it = nickIndex.find(ircCasefold(client.nickname));
+    if (it != nickIndex.end() && it->second == clientSockfd)
+        nickIndex.erase(it);
+    hostIndex.erase(std::make_pair(ircCasefold(client.hostname), clientSockfd));
+}
+
+int findClientByFoldedNick(const std::string& foldedNick) {
+    std::map<std::string, int>::const_iterator it = nickIndex.find(foldedNick);
+    return it == nickIndex.end() ? -1 : it->second;
+}
+
+
+static void sendWhoReply(int clientSockfd, int targetSockfd, const std::string& channelName) {
+    const Client& target = clients[targetSockfd];
+    sendMessage(clientSockfd, ":localhost 352 " + clients[clientSockfd].nickname + " " + channelName + " " + target.username
+                + " " + target.hostname + " localhost " + target.nickname + " H :0 " + target.realname + "\r\n");
+}
+
+static bool hasRoom(int clientSockfd) {
+    const Client& client = clients[clientSockfd];
+    return client.quitReason.empty() && client.outBuffer.size() < MAX_SENDQ / 4;
+}
+
+// Each run scans at most QUERY_BATCH_SIZE entries and stops early once the
+// client's output queue fills up. Returns true when the query is complete.
+static bool runList(int clientSockfd, PendingQuery& query) {
+    SizeIndex::iterator it;
+    if (query.started)
+        it = channelsBySize.upper_bound(query.lastChannel);
+    else if (query.maxUsers >= 0)
+        it = channelsBySize.lower_bound(SizeKey(query.maxUsers - 1, INT_MAX));
+    else
+        it = channelsBySize.begin();
+
+    for (int scanned = 0; it != channelsBySize.end(); ++it, ++scanned) {
+        if (scanned >= QUERY_BATCH_SIZE || !hasRoom(clientSockfd))
+            return false;
+        if (it->first <= query.minUsers)
+            break;
+        query.started = true;
+        query.lastChannel = *it;
+
+        const Channel& channel = channels[it->second];
+        if (!query.names.empty()) {
+            std::string folded = ircCasefold(channel.name);
+            bool matched = false;
+            for (size_t i = 0; i < query.names.size() && !matched; ++i)
+                matched = matchMask(query.names[i], folded);
+            if (!matched)
+                continue;
+        }
+
+        std::ostringstream oss;
+        oss << ":localhost 322 " << clients[clientSockfd].nickname << " " << channel.name << " "
+            << channel.clients.size() << " :" << channel.topic << "\r\n";
+        sendMessage(clientSockfd, oss.str());
+    }
+
+    sendMessage(clientSockfd, ":localhost 323 " + clients[clientSockfd].nickname + " :End of LIST\r\n");
+    return true;
+}
+
+static bool runWho(int clientSockfd, PendingQuery& query) {
+    int scanned = 0;
+
+    if (query.kind == PendingQuery::WHO_CHANNEL) {
+        // A channel erased since the last batch ends the listing, even if
+        // its id now belongs to another channel
+        if (channels.isActive(query.channelId) && ircCasefold(channels[query.channelId].name) == query.channelName) {
+            const Channel& channel = channels[query.channelId];
+            for (; query.position < channel.clients.size(); ++query.position, ++scanned) {
+                if (scanned >= QUERY_BATCH_SIZE || !hasRoom(clientSockfd))
+                    return false;
+                sendWhoReply(clientSockfd, channel.clients[query.position], channel.name);
+            }
+        }
+    }
+
+    if (query.kind == PendingQuery::WHO_NICK) {
+        std::map<std::string, int>::iterator it = query.started ? nickIndex.upper_bound(query.lastClient.first)
+                                                                : nickIndex.lower_bound(query.prefix);
+        for (; it != nickIndex.end() && hasPrefix(it->first, query.prefix); ++it, ++scanned) {
+            if (scanned >= QUERY_BATCH_SIZE || !hasRoom(clientSockfd))
+                return false;
+            query.started = true;
+            query.lastClient.first = it->first;
+            if (matchMask(query.who, it->first))
+                sendWhoReply(clientSockfd, it->second, "*");
+        }
+        query.kind = PendingQuery::WHO_HOST;
+        query.started = false;
+    }
+
+    if (query.kind == PendingQuery::WHO_HOST) {
+        std::set<std::pair<std::string, int> >::iterator it = query.started ? hostIndex.upper_bound(query.lastClient)
+                                                                            : hostIndex.lower_bound(std::make_pair(query.prefix, INT_MIN));
+        for (; it != hostIndex.end() && hasPrefix(it->first, query.prefix); ++it, ++scanned) {
+            if (scanned >= QUERY_BATCH_SIZE || !hasRoom(clientSockfd))
+                return false;
+            query.started = true;
+            query.lastClient = *it;
+            // Clients whose nick also matches were already listed in the nick pass
+            if (matchMask(query.who, it->first) && !matchMask(query.who, ircCasefold(clients[it->second].nickname)))
+                sendWhoReply(clientSockfd, it->second, "*");
+        }
+    }
+
+    sendMessage(clientSockfd, ":localhost 315 " + clients[clientSockfd].nickname + " " + query.mask + " :End of WHO list\r\n");
+    return true;
+}
+
+static bool runQuery(int clientSockfd, PendingQuery& query) {
+    return query.kind == PendingQuery::LIST ? runList(clientSockfd, query) : runWho(clientSockfd, query);
+}
+
+static void startQuery(int clientSockfd, const PendingQuery& query) {
+    pendingQueries[clientSockfd] = query;
+    if (runQuery(clientSockfd, pendingQueries[clientSockfd]))
+        pendingQueries.erase(clientSockfd);
+}
+
+
+// LIST [<mask>{,<mask>}] where a mask may also be >n or <n (member count)
+void handleList(int clientSockfd, const std::string& args) {
+    PendingQuery query;
+    query.kind = PendingQuery::LIST;
+
+    std::istringstream iss(args);
+    std::string params;
+    iss >> params;
+
+    std::istringstream paramStream(params);
+    std::string param;
+    while (std::getline(paramStream, param, ',')) {
+        if (param.empty())
+            continue;
+        if (param[0] == '>') {
+            query.minUsers = std::atoi(param.c_str() + 1);
+        } else if (param[0] == '<') {
+            query.maxUsers = std::max(0, std::atoi(param.c_str() + 1));
+        } else {
+            query.names.push_back(compileMask(param));
+        }
+    }
+
+    cancelQueries(clientSockfd);
+    sendMessage(clientSockfd, ":localhost 321 " + clients[clientSockfd].nickname + " Channel :Users  Name\r\n");
+    startQuery(clientSockfd, query);
+}
+
+// WHO <#channel> lists members; any other mask matches nicks and hosts
+void handleWho(int clientSockfd, const std::string& args) {
+    PendingQuery query;
+    std::istringstream iss(args);
+    iss >> query.mask;
+    std::string pattern = (query.mask.empty() || query.mask == "0") ? "*" : query.mask;
+
+    if (pattern[0] == '#') {
+        query.kind = PendingQuery::WHO_CHANNEL;
+        query.channelId = channels.find(pattern);
+        query.channelName = ircCasefold(pattern);
+    } else {
+        query.kind = PendingQuery::WHO_NICK;
+        query.who = compileMask(pattern);
+        query.prefix = maskPrefix(pattern);
+    }
+
+    cancelQueries(clientSockfd);
+    startQuery(clientSockfd, query);
+}
+
+void handleWhois(int clientSockfd, const std::string& args) {
+    std::istringstream iss(args);
+    std::string nick;
+    iss >> nick;
+
+    const std::string& me = clients[clientSockfd].nickname;
+    if (nick.empty()) {
+        sendMessage(clientSockfd, ":localhost 431 " + me + " :No nickname given\r\n");
+        return;
+    }
+
+    std::map<std::string, int>::iterator it = nickIndex.find(ircCasefold(nick));
+    if (it == nickIndex.end()) {
+        sendMessage(clientSockfd, ":localhost 401 " + me + " " + nick + " :No such nick\r\n");
+    } else {
+        const Client& target = clients[it->second];
+        std::string channelList;
+        for (std::vector<ChannelId>::const_iterator id = target.channels.begin(); id != target.channels.end(); ++id) {
+            channelList += (isChannelOperator(it->second, *id) ? "@" : "") + channels[*id].name + " ";
+        }
+
+        sendMessage(clientSockfd, ":localhost 311 " + me + " " + target.nickname + " " + target.username + " "
+                    + target.hostname + " * :" + target.realname + "\r\n");
+        if (!channelList.empty())
+            sendMessage(clientSockfd, ":localhost 319 " + me + " " + target.nickname + " :" + channelList + "\r\n");
+        sendMessage(clientSockfd, ":localhost 312 " + me + " " + target.nickname + " localhost :ft_irc server\r\n");
+    }
+    sendMessage(clientSockfd, ":localhost 318 " + me + " " + nick + " :End of WHOIS list\r\n");
+}
+
+// Indexes and suspended queries, for STATS z
+size_t queryBytes() {
+    size_t total = channelsBySize.size() * (TREE_NODE_BYTES + sizeof(SizeKey))
+                 + nickIndex.size() * (TREE_NODE_BYTES + sizeof(std::pair<const std::string, int>))
+                 + hostIndex.size() * (TREE_NODE_BYTES + sizeof(std::pair<std::string, int>))
+                 + pendingQueries.size() * (TREE_NODE_BYTES + sizeof(std::pair<const int, PendingQuery>));
+    for (std::map<std::string, int>::const_iterator it = nickIndex.begin(); it != nickIndex.end(); ++it)
+        total += it->first.capacity();
+    for (std::set<std::pair<std::string, int> >::const_iterator it = hostIndex.begin(); it != hostIndex.end(); ++it)
+        total += it->first.capacity();
+    for (std::map<int, PendingQuery>::const_iterator it = pendingQueries.begin(); it != pendingQueries.end(); ++it) {
+        total += it->second.names.capacity() * sizeof(CompiledMask) + it->second.mask.capacity()
+               + it->second.prefix.capacity() + it->second.lastClient.first.capacity();
+    }
+    return total;
+}
+
+// Advances every query whose client has drained enough output. Returns true
+// if some query can make progress right away (the caller should not block).
+bool resumeQueries() {
+    bool runnable = false;
+    for (std::map<int, PendingQuery>::iterator it = pendingQueries.begin(); it != pendingQueries.end();) {
+        if (hasRoom(it->first) && runQuery(it->first, it->second)) {
+            pendingQueries.erase(it++);
+            continue;
+        }
+        runnable = runnable || hasRoom(it->first);
+        ++it;
+    }
+    return runnable;
+}
+
+void cancelQueries(int clientSockfd) {
+    pendingQueries.erase(clientSockfd);
+}
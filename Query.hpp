@@ -0,0 +1,21 @@
+#ifndef QUERY_HPP
+#define QUERY_HPP
+
+#include "Channel.hpp"
+
+// Entries scanned per batch before a LIST/WHO yields back to the event loop
+#define QUERY_BATCH_SIZE 256
+
+void updateChannelIndex(ChannelId channelId, size_t oldMemberCount);
+void indexClient(int clientSockfd);
+void unindexClient(int clientSockfd);
+int findClientByFoldedNick(const std::string& foldedNick);
+size_t queryBytes();
+
+void handleList(int clientSockfd, const std::string& args);
+void handleWho(int clientSockfd, const std::string& mask);
+void handleWhois(int clientSockfd, const std::string& nick);
+bool resumeQueries();
+void cancelQueries(int clientSockfd);
+
+#endif // QUERY_HPP
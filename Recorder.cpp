@@ -0,0 +1,182 @@
+#include "Recorder.hpp"
+#include "LowLatency.hpp"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sstream>
+#include <unistd.h>
+
+static TraceEvent ring[TRACE_RING_SIZE];
+static uint64_t ringHead = 0;
+
+static TraceEvent current;
+bool traceSampling = false;
+static unsigned int sampleRate = TRACE_DEFAULT_SAMPLE_RATE;
+static unsigned int sampleCounter = 0;
+
+static volatile sig_atomic_t dumpRequested = 0;
+
+uint64_t traceClock() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+bool traceEnabled() {
+    return sampleRate != 0;
+}
+
+void traceSetSampleRate(unsigned int oneIn) {
+    sampleRate = oneIn;
+    sampleCounter = 0;
+}
+
+unsigned int traceSampleRate() {
+    return sampleRate;
+}
+
+// The command is the line up to its first space, copied only when sampled
+void traceBegin(int fd, uint64_t recvTime, const char *line, size_t length) {
+    traceEnd();
+    if (!sampleRate || recvTime == 0 || ++sampleCounter < sampleRate)
+        return;
+    sampleCounter = 0;
+
+    std::memset(&current, 0, sizeof(current));
+    current.timestamps[TRACE_RECV] = recvTime;
+    current.fd = fd;
+    for (size_t i = 0; i < length && i < sizeof(current.command) - 1 && line[i] != ' '; ++i)
+        current.command[i] = line[i];
+    traceSampling = true;
+}
+
+// Starts keep the first time they were reached, ends keep the last one
+void traceMark(TracePoint point) {
+    if (!traceSampling)
+        return;
+    if (point == TRACE_FANOUT_START && current.timestamps[point] != 0)
+        return;
+    current.timestamps[point] = traceClock();
+}
+
+void traceFanout(unsigned int recipients) {
+    if (traceSampling)
+        current.fanout += recipients;
+}
+
+void traceQueued() {
+    if (traceSampling)
+        current.flags |= TRACE_FLAG_QUEUED;
+}
+
+void traceEnd() {
+    if (!traceSampling)
+        return;
+    ring[ringHead & (TRACE_RING_SIZE - 1)] = current;
+    ++ringHead;
+    traceSampling = false;
+}
+
+static void handleDumpSignal(int) {
+    dumpRequested = 1;
+}
+
+void traceInstallSignalHandler() {
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleDumpSignal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+}
+
+// Blocks SIGUSR2 in the calling thread, so threads it creates inherit the
+// mask and the signal always lands on the event loop. Restore the old
+// mask with pthread_sigmask(SIG_SETMASK, &saved, NULL).
+void traceBlockDumpSignal(sigset_t& saved) {
+    sigset_t dumpSignal;
+    sigemptyset(&dumpSignal);
+    sigaddset(&dumpSignal, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &dumpSignal, &saved);
+}
+
+bool traceDumpRequested() {
+    if (!dumpRequested)
+        return false;
+    dumpRequested = 0;
+    return true;
+}
+
+struct DumpJob {
+    int fd;
+    char *data;
+    size_t size;
+};
+
+static void writeDump(DumpJob *job) {
+    for (size_t offset = 0; offset < job->size;) {
+        ssize_t written = write(job->fd, job->data + offset, job->size - offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        offset += written;
+    }
+    close(job->fd);
+    delete[] job->data;
+    delete job;
+}
+
+static void *dumpMain(void *arg) {
+    lowLatencyReleaseThread();
+    writeDump(static_cast<DumpJob*>(arg));
+    return NULL;
+}
+
+// Copies the ring, oldest event first, and hands the copy to a detached
+// thread so the disk write never stalls the loop. Returns the file name
+// ("" if it could not be created).
+std::string traceDump() {
+    // Numbered, so a dump still being written is never truncated by the next
+    static unsigned int dumpCount = 0;
+    std::ostringstream path;
+    path << "ircserv-trace-" << getpid() << "-" << time(NULL) << "-" << ++dumpCount << ".bin";
+
+    int fd = open(path.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return "";
+
+    uint64_t count = ringHead < TRACE_RING_SIZE ? ringHead : TRACE_RING_SIZE;
+    DumpJob *job = new DumpJob;
+    job->fd = fd;
+    job->size = sizeof(TraceHeader) + count * sizeof(TraceEvent);
+    job->data = new char[job->size];
+
+    TraceHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.eventSize = sizeof(TraceEvent);
+    header.eventCount = count;
+    std::memcpy(job->data, &header, sizeof(header));
+
+    // The ring may wrap, so the oldest events are copied in up to two runs
+    char *out = job->data + sizeof(header);
+    uint64_t first = (ringHead - count) & (TRACE_RING_SIZE - 1);
+    uint64_t firstRun = count < TRACE_RING_SIZE - first ? count : TRACE_RING_SIZE - first;
+    std::memcpy(out, &ring[first], firstRun * sizeof(TraceEvent));
+    std::memcpy(out + firstRun * sizeof(TraceEvent), &ring[0], (count - firstRun) * sizeof(TraceEvent));
+
+    sigset_t saved;
+    traceBlockDumpSignal(saved);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, dumpMain, job) == 0)
+        pthread_detach(thread);
+    else
+        writeDump(job);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return path.str();
+}
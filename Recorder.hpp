@@ -0,0 +1,69 @@
+#ifndef RECORDER_HPP
+#define RECORDER_HPP
+
+#include <csignal>
+#include <string>
+#include <stdint.h>
+
+// Flight recorder: sampled inbound lines leave one fixed-size event in a
+// ring that is dumped on SIGUSR2 or RECORDER DUMP. The reactor is single
+// threaded, so the ring has exactly one writer and needs no locking.
+// Dumps copy the ring and write the copy from a detached thread.
+
+#define TRACE_RING_SIZE 65536           // events, power of two
+#define TRACE_DEFAULT_SAMPLE_RATE 1     // record 1 line in N, 0 disables
+#define TRACE_MAX_SAMPLE_RATE 1000000  // largest N RECORDER accepts
+#define TRACE_MAGIC "IRCTRACE"
+#define TRACE_VERSION 1
+
+enum TracePoint {
+    TRACE_RECV,
+    TRACE_PARSE,
+    TRACE_DISPATCH,
+    TRACE_FANOUT_START,
+    TRACE_FANOUT_END,
+    TRACE_FLUSH,
+    TRACE_POINT_COUNT
+};
+
+#define TRACE_FLAG_QUEUED 1             // some reply was queued rather than sent
+
+// On-disk layout, little endian; times are CLOCK_MONOTONIC nanoseconds and
+// a zero timestamp means the line never reached that point.
+struct TraceEvent {
+    uint64_t timestamps[TRACE_POINT_COUNT];
+    int32_t fd;
+    uint32_t fanout;
+    uint32_t flags;
+    char command[20];
+};
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t eventSize;
+    uint64_t eventCount;
+};
+
+uint64_t traceClock();
+bool traceEnabled();
+void traceSetSampleRate(unsigned int oneIn);
+unsigned int traceSampleRate();
+
+// True while the current line is sampled; hot paths test it before
+// calling the hooks below
+extern bool traceSampling;
+inline bool traceActive() { return traceSampling; }
+
+void traceBegin(int fd, uint64_t recvTime, const char *line, size_t length);
+void traceMark(TracePoint point);
+void traceFanout(unsigned int recipients);
+void traceQueued();
+void traceEnd();
+
+void traceInstallSignalHandler();
+void traceBlockDumpSignal(sigset_t& saved);
+bool traceDumpRequested();
+std::string traceDump();
+
+#endif // RECORDER_HPP
@@ -0,0 +1,386 @@
+#include "Registry.hpp"
+#include "Query.hpp"
+#include "Recorder.hpp"
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum RecordType {
+    RECORD_UPSERT = 1,
+    RECORD_REMOVE = 2
+};
+
+enum ChannelFlags {
+    FLAG_INVITE_ONLY = 1,
+    FLAG_TOPIC_RESTRICTED = 2
+};
+
+struct WriteJob {
+    bool snapshot;
+    std::string data;
+};
+
+static std::string journalPath;
+static std::string snapshotPath;
+static int journalFd = -1;
+static size_t journalBytes = 0;
+
+static pthread_t writerThread;
+static pthread_mutex_t queueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+static std::deque<WriteJob> writeQueue;
+
+static uint32_t crc32(const char *data, size_t length) {
+    static uint32_t table[256];
+    static bool tableReady = false;
+    if (!tableReady) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        tableReady = true;
+    }
+
+    uint32_t crc = 0xFFFFFFFFU;
+    for (size_t i = 0; i < length; ++i)
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFU;
+}
+
+static void putU32(std::string& out, uint32_t value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void putString(std::string& out, const std::string& str) {
+    putU32(out, static_cast<uint32_t>(str.length()));
+    out += str;
+}
+
+static bool getU32(const char *&pos, const char *end, uint32_t& value) {
+    if (end - pos < static_cast<std::ptrdiff_t>(sizeof(value)))
+        return false;
+    std::memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+}
+
+static bool getString(const char *&pos, const char *end, std::string& str) {
+    uint32_t length;
+    if (!getU32(pos, end, length) || static_cast<uint32_t>(end - pos) < length)
+        return false;
+    str.assign(pos, length);
+    pos += length;
+    return true;
+}
+
+static uint32_t channelFlags(const Channel& channel) {
+    return (channel.inviteOnly ? FLAG_INVITE_ONLY : 0) | (channel.topicRestricted ? FLAG_TOPIC_RESTRICTED : 0);
+}
+
+// Creates or updates a registered channel while loading
+static void restoreChannel(const std::string& name, const std::string& topic, const std::string& key,
+                           int userLimit, uint32_t flags) {
+    ChannelId channelId = channels.find(name);
+    size_t oldMemberCount = 0;
+    if (channelId == NO_CHANNEL)
+        channelId = channels.create(name);
+    else
+        oldMemberCount = channels[channelId].clients.size();
+    Channel& channel = channels[channelId];
+    channel.topic = topic;
+    channel.key = key;
+    channel.userLimit = userLimit;
+    channel.inviteOnly = flags & FLAG_INVITE_ONLY;
+    channel.topicRestricted = flags & FLAG_TOPIC_RESTRICTED;
+    channel.persistent = true;
+    updateChannelIndex(channelId, oldMemberCount);
+}
+
+static void loadSnapshot() {
+    int fd = open(snapshotPath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+        close(fd);
+        return;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    const char *base = static_cast<const char*>(map);
+    const SnapshotHeader *header = reinterpret_cast<const SnapshotHeader*>(base);
+    size_t bodySize = st.st_size - sizeof(SnapshotHeader);
+    size_t entriesSize = static_cast<size_t>(header->count) * sizeof(SnapshotEntry);
+
+    if (std::memcmp(header->magic, REGISTRY_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+        || entriesSize + header->blobSize != bodySize
+        || crc32(base + sizeof(SnapshotHeader), bodySize) != header->checksum) {
+        std::cerr << "Ignoring corrupt " << snapshotPath << std::endl;
+        munmap(map, st.st_size);
+        return;
+    }
+
+    const SnapshotEntry *entries = reinterpret_cast<const SnapshotEntry*>(base + sizeof(SnapshotHeader));
+    const char *blob = base + sizeof(SnapshotHeader) + entriesSize;
+    for (uint32_t i = 0; i < header->count; ++i) {
+        const SnapshotEntry& entry = entries[i];
+        if (static_cast<uint64_t>(entry.nameOffset) + entry.nameLength > header->blobSize
+            || static_cast<uint64_t>(entry.topicOffset) + entry.topicLength > header->blobSize
+            || static_cast<uint64_t>(entry.keyOffset) + entry.keyLength > header->blobSize)
+            continue;
+        restoreChannel(std::string(blob + entry.nameOffset, entry.nameLength),
+                       std::string(blob + entry.topicOffset, entry.topicLength),
+                       std::string(blob + entry.keyOffset, entry.keyLength),
+                       entry.userLimit, entry.flags);
+    }
+    munmap(map, st.st_size);
+}
+
+// Replays records up to the first torn or corrupt one, which is cut off
+static void replayJournal() {
+    struct stat st;
+    if (fstat(journalFd, &st) < 0 || st.st_size == 0)
+        return;
+
+    std::string data(st.st_size, '\0');
+    if (pread(journalFd, &data[0], data.size(), 0) != static_cast<ssize_t>(data.size()))
+        return;
+
+    const char *pos = data.data();
+    const char *end = pos + data.size();
+    while (pos < end) {
+        const char *recordStart = pos;
+        uint32_t length, checksum;
+        if (!getU32(pos, end, length) || !getU32(pos, end, checksum)
+            || static_cast<uint32_t>(end - pos) < length || crc32(pos, length) != checksum) {
+            std::cerr << "Truncating " << journalPath << " at offset " << (recordStart - data.data()) << std::endl;
+            if (ftruncate(journalFd, recordStart - data.data()) < 0)
+                std::cerr << "Error truncating " << journalPath << std::endl;
+            break;
+        }
+
+        const char *record = pos;
+        const char *recordEnd = pos + length;
+        pos = recordEnd;
+
+        uint32_t type, flags, limit;
+        std::string name, topic, key;
+        if (!getU32(record, recordEnd, type) || !getString(record, recordEnd, name))
+            continue;
+        if (type == RECORD_UPSERT && getU32(record, recordEnd, flags) && getU32(record, recordEnd, limit)
+            && getString(record, recordEnd, topic) && getString(record, recordEnd, key)) {
+            restoreChannel(name, topic, key, static_cast<int32_t>(limit), flags);
+        } else if (type == RECORD_REMOVE) {
+            ChannelId channelId = channels.find(name);
+            if (channelId != NO_CHANNEL) {
+                channels.erase(channelId);
+                updateChannelIndex(channelId, 0);
+            }
+        }
+    }
+    journalBytes = pos - data.data();
+}
+
+static void writeAll(int fd, const std::string& data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t written = write(fd, data.data() + offset, data.size() - offset);
+        if (written <= 0) {
+            std::cerr << "Registry write failed" << std::endl;
+            return;
+        }
+        offset += written;
+    }
+}
+
+static void writeSnapshot(const std::string& data) {
+    std::string tmpPath = snapshotPath + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "Error creating " << tmpPath << std::endl;
+        return;
+    }
+    writeAll(fd, data);
+    fsync(fd);
+    close(fd);
+
+    // The journal is only emptied once the snapshot replacing it is durable
+    if (rename(tmpPath.c_str(), snapshotPath.c_str()) == 0 && ftruncate(journalFd, 0) == 0)
+        fdatasync(journalFd);
+}
+
+static void *writerMain(void *) {
+    while (true) {
+        std::deque<WriteJob> jobs;
+        pthread_mutex_lock(&queueMutex);
+        while (writeQueue.empty())
+            pthread_cond_wait(&queueCond, &queueMutex);
+        jobs.swap(writeQueue);
+        pthread_mutex_unlock(&queueMutex);
+
+        bool dirty = false;
+        for (std::deque<WriteJob>::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+            if (it->snapshot) {
+                if (dirty)
+                    fdatasync(journalFd);
+                writeSnapshot(it->data);
+                dirty = false;
+            } else {
+                writeAll(journalFd, it->data);
+                dirty = true;
+            }
+        }
+        if (dirty)
+            fdatasync(journalFd);
+    }
+    return NULL;
+}
+
+static void enqueue(bool snapshot, std::string& data) {
+    WriteJob job;
+    job.snapshot = snapshot;
+    pthread_mutex_lock(&queueMutex);
+    writeQueue.push_back(job);
+    writeQueue.back().data.swap(data);
+    pthread_cond_signal(&queueCond);
+    pthread_mutex_unlock(&queueMutex);
+}
+
+static void appendRecord(const std::string& payload) {
+    if (journalFd < 0)
+        return;
+    std::string record;
+    putU32(record, static_cast<uint32_t>(payload.length()));
+    putU32(record, crc32(payload.data(), payload.length()));
+    record += payload;
+    journalBytes += record.length();
+    enqueue(false, record);
+}
+
+bool registryOpen(const std::string& directory) {
+    // Resolved once, so the files stay put whatever the working directory
+    char *resolved = realpath(directory.c_str(), NULL);
+    if (!resolved) {
+        std::cerr << "Error opening state directory " << directory << std::endl;
+        return false;
+    }
+    std::string base = resolved;
+    free(resolved);
+    journalPath = base + "/" + REGISTRY_JOURNAL;
+    snapshotPath = base + "/" + REGISTRY_SNAPSHOT;
+
+    journalFd = open(journalPath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (journalFd < 0) {
+        std::cerr << "Error opening " << journalPath << std::endl;
+        return false;
+    }
+
+    uint64_t start = traceClock();
+    loadSnapshot();
+    replayJournal();
+    std::cout << "Persistent channels in " << base << ": " << channels.size() << " restored in "
+              << (traceClock() - start) / 1000000.0 << " ms" << std::endl;
+
+    sigset_t saved;
+    traceBlockDumpSignal(saved);
+    int failed = pthread_create(&writerThread, NULL, writerMain, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (failed != 0) {
+        std::cerr << "Error starting registry writer" << std::endl;
+        close(journalFd);
+        journalFd = -1;
+        return false;
+    }
+    pthread_detach(writerThread);
+    return true;
+}
+
+void registryUpdate(ChannelId channelId) {
+    const Channel& channel = channels[channelId];
+    if (!channel.persistent)
+        return;
+
+    std::string payload;
+    putU32(payload, RECORD_UPSERT);
+    putString(payload, channel.name);
+    putU32(payload, channelFlags(channel));
+    putU32(payload, static_cast<uint32_t>(channel.userLimit));
+    putString(payload, channel.topic);
+    putString(payload, channel.key);
+    appendRecord(payload);
+}
+
+void registryRemove(const std::string& channelName) {
+    std::string payload;
+    putU32(payload, RECORD_REMOVE);
+    putString(payload, channelName);
+    appendRecord(payload);
+}
+
+// Folds the journal into a fresh snapshot once it has grown large enough
+void registryMaybeCompact() {
+    if (journalFd < 0 || journalBytes < REGISTRY_COMPACT_BYTES)
+        return;
+
+    std::vector<SnapshotEntry> entries;
+    std::string blob;
+    for (ChannelId id = 0; id < channels.slotCount(); ++id) {
+        if (!channels.isActive(id) || !channels[id].persistent)
+            continue;
+        const Channel& channel = channels[id];
+        SnapshotEntry entry;
+        entry.nameOffset = blob.size();
+        entry.nameLength = channel.name.length();
+        blob += channel.name;
+        entry.topicOffset = blob.size();
+        entry.topicLength = channel.topic.length();
+        blob += channel.topic;
+        entry.keyOffset = blob.size();
+        entry.keyLength = channel.key.length();
+        blob += channel.key;
+        entry.userLimit = channel.userLimit;
+        entry.flags = channelFlags(channel);
+        entries.push_back(entry);
+    }
+
+    std::string body;
+    if (!entries.empty())
+        body.assign(reinterpret_cast<const char*>(&entries[0]), entries.size() * sizeof(SnapshotEntry));
+    body += blob;
+
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, REGISTRY_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.count = entries.size();
+    header.checksum = crc32(body.data(), body.size());
+    header.blobSize = blob.size();
+
+    std::string snapshot(reinterpret_cast<const char*>(&header), sizeof(header));
+    snapshot += body;
+    enqueue(true, snapshot);
+    journalBytes = 0;
+}
+
+// Records not yet handed to the disk, for STATS z
+size_t registryQueueBytes() {
+    pthread_mutex_lock(&queueMutex);
+    size_t total = writeQueue.size() * sizeof(WriteJob);
+    for (std::deque<WriteJob>::const_iterator it = writeQueue.begin(); it != writeQueue.end(); ++it)
+        total += it->data.capacity();
+    pthread_mutex_unlock(&queueMutex);
+    return total;
+}
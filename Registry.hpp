@@ -0,0 +1,46 @@
+#ifndef REGISTRY_HPP
+#define REGISTRY_HPP
+
+#include "Channel.hpp"
+#include <stdint.h>
+
+// Persistent channel registry. Channels marked +P survive restarts and
+// becoming empty. Every change appends a checksummed record to the
+// journal; once the journal grows past REGISTRY_COMPACT_BYTES its content
+// is folded into a snapshot that startup maps straight into memory, so
+// only the journal tail has to be replayed. All file I/O happens on a
+// writer thread so the event loop never waits on the disk. Both files live
+// in the state directory given on the command line (REGISTRY_DEFAULT_DIR
+// if none), which is logged at startup with the restore time.
+
+#define REGISTRY_DEFAULT_DIR "."
+#define REGISTRY_JOURNAL "channels.journal"
+#define REGISTRY_SNAPSHOT "channels.snapshot"
+#define REGISTRY_COMPACT_BYTES (1024 * 1024)
+#define REGISTRY_SNAPSHOT_MAGIC "IRCSNAP1"
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t count;
+    uint32_t checksum;      // CRC-32 of everything after the header
+    uint64_t blobSize;
+};
+
+struct SnapshotEntry {
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    uint32_t topicOffset;
+    uint32_t topicLength;
+    uint32_t keyOffset;
+    uint32_t keyLength;
+    int32_t userLimit;
+    uint32_t flags;
+};
+
+bool registryOpen(const std::string& directory);
+void registryUpdate(ChannelId channelId);
+void registryRemove(const std::string& channelName);
+void registryMaybeCompact();
+size_t registryQueueBytes();
+
+#endif // REGISTRY_HPP
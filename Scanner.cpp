@@ -0,0 +1,227 @@
+#include "Scanner.hpp"
+#include <stdint.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define SCANNER_HAVE_AVX2
+#endif
+
+struct BlockMasks {
+    uint64_t lf;
+    uint64_t cr;
+    uint64_t nul;
+    uint64_t high;
+};
+
+static void classifyScalar(const char *data, size_t length, BlockMasks& masks) {
+    masks.lf = masks.cr = masks.nul = masks.high = 0;
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = data[i];
+        uint64_t bit = 1ULL << i;
+        if (c == '\n')
+            masks.lf |= bit;
+        else if (c == '\r')
+            masks.cr |= bit;
+        else if (c == '\0')
+            masks.nul |= bit;
+        else if (c & 0x80)
+            masks.high |= bit;
+    }
+}
+
+#ifdef __SSE2__
+static void classifySse2(const char *data, size_t blocks, BlockMasks *out) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i zero = _mm_setzero_si128();
+    for (size_t b = 0; b < blocks; ++b) {
+        BlockMasks& masks = out[b];
+        masks.lf = masks.cr = masks.nul = masks.high = 0;
+        for (int part = 0; part < 4; ++part) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + b * 64 + part * 16));
+            int shift = part * 16;
+            masks.lf |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, lf)))) << shift;
+            masks.cr |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, cr)))) << shift;
+            masks.nul |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero)))) << shift;
+            masks.high |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(chunk))) << shift;
+        }
+    }
+}
+#endif
+
+#ifdef SCANNER_HAVE_AVX2
+__attribute__((target("avx2")))
+static void classifyAvx2(const char *data, size_t blocks, BlockMasks *out) {
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i zero = _mm256_setzero_si256();
+    for (size_t b = 0; b < blocks; ++b) {
+        __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + b * 64));
+        __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + b * 64 + 32));
+        BlockMasks& masks = out[b];
+        masks.lf = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, lf)))
+                 | static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, lf)))) << 32;
+        masks.cr = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, cr)))
+                 | static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, cr)))) << 32;
+        masks.nul = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, zero)))
+                  | static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, zero)))) << 32;
+        masks.high = static_cast<uint32_t>(_mm256_movemask_epi8(low))
+                   | static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(high))) << 32;
+    }
+}
+#endif
+
+ScanLevel scanBestLevel() {
+    static int level = -1;
+    if (level < 0) {
+        level = SCAN_SCALAR;
+#ifdef __SSE2__
+        level = SCAN_SSE2;
+#endif
+#ifdef SCANNER_HAVE_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            level = SCAN_AVX2;
+#endif
+    }
+    return static_cast<ScanLevel>(level);
+}
+
+const char *scanLevelName(ScanLevel level) {
+    if (level == SCAN_AVX2)
+        return "avx2";
+    if (level == SCAN_SSE2)
+        return "sse2";
+    return "scalar";
+}
+
+// Rejects overlong forms, surrogates and code points above U+10FFFF
+bool isValidUtf8(const unsigned char *data, size_t length) {
+    size_t i = 0;
+    while (i < length) {
+        unsigned char c = data[i];
+        if (c < 0x80) {
+            ++i;
+            continue;
+        }
+
+        size_t extra;
+        unsigned char min = 0x80, max = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            extra = 1;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            extra = 2;
+            if (c == 0xE0)
+                min = 0xA0;
+            else if (c == 0xED)
+                max = 0x9F;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            extra = 3;
+            if (c == 0xF0)
+                min = 0x90;
+            else if (c == 0xF4)
+                max = 0x8F;
+        } else {
+            return false;
+        }
+
+        if (length - i <= extra || data[i + 1] < min || data[i + 1] > max)
+            return false;
+        for (size_t k = 2; k <= extra; ++k) {
+            if ((data[i + k] & 0xC0) != 0x80)
+                return false;
+        }
+        i += extra + 1;
+    }
+    return true;
+}
+
+// Lines with non-ASCII bytes come in flagged and keep LINE_INVALID_UTF8
+// only if they really are not UTF-8
+static void emitLine(const char *data, size_t start, size_t lf, unsigned int flags, std::vector<LineSpan>& lines) {
+    size_t end = lf;
+    if (end > start && data[end - 1] == '\r')
+        --end;
+    while (start < end && data[start] == ' ')
+        ++start;
+    while (end > start && data[end - 1] == ' ')
+        --end;
+
+    if ((flags & LINE_INVALID_UTF8) && isValidUtf8(reinterpret_cast<const unsigned char*>(data + start), end - start))
+        flags &= ~LINE_INVALID_UTF8;
+
+    LineSpan line;
+    line.start = start;
+    line.length = end - start;
+    line.end = lf + 1;
+    line.flags = flags;
+    lines.push_back(line);
+}
+
+// Bits [from, to) of a block mask; from and to may be 64
+static uint64_t bitRange(unsigned int from, unsigned int to) {
+    uint64_t below = to >= 64 ? ~0ULL : (1ULL << to) - 1;
+    uint64_t skipped = from >= 64 ? ~0ULL : (1ULL << from) - 1;
+    return below & ~skipped;
+}
+
+size_t scanLinesWith(ScanLevel level, const char *data, size_t length, std::vector<LineSpan>& lines) {
+    static std::vector<BlockMasks> blocks;
+    size_t fullBlocks = length / 64;
+    blocks.resize(fullBlocks + 1);
+
+#ifdef SCANNER_HAVE_AVX2
+    if (level == SCAN_AVX2)
+        classifyAvx2(data, fullBlocks, &blocks[0]);
+    else
+#endif
+#ifdef __SSE2__
+    if (level == SCAN_SSE2)
+        classifySse2(data, fullBlocks, &blocks[0]);
+    else
+#endif
+    for (size_t b = 0; b < fullBlocks; ++b)
+        classifyScalar(data + b * 64, 64, blocks[b]);
+    classifyScalar(data + fullBlocks * 64, length - fullBlocks * 64, blocks[fullBlocks]);
+
+    size_t lineStart = 0;
+    unsigned int flags = 0;
+    for (size_t b = 0; b <= fullBlocks; ++b) {
+        const BlockMasks& masks = blocks[b];
+        size_t base = b * 64;
+
+        // A CR is only legal when the next byte, possibly in the next block, is LF
+        uint64_t nextLf = (b < fullBlocks) ? (blocks[b + 1].lf & 1) << 63 : 0;
+        uint64_t illegal = masks.nul | (masks.cr & ~((masks.lf >> 1) | nextLf));
+        if (!(masks.lf | illegal | masks.high))
+            continue;
+
+        unsigned int from = lineStart > base ? static_cast<unsigned int>(lineStart - base) : 0;
+        for (uint64_t lf = masks.lf; lf; lf &= lf - 1) {
+            unsigned int bit = __builtin_ctzll(lf);
+            uint64_t segment = bitRange(from, bit);
+            if (illegal & segment)
+                flags |= LINE_ILLEGAL_BYTE;
+            if (masks.high & segment)
+                flags |= LINE_INVALID_UTF8;
+            emitLine(data, lineStart, base + bit, flags, lines);
+            lineStart = base + bit + 1;
+            flags = 0;
+            from = bit + 1;
+        }
+
+        uint64_t rest = bitRange(from, 64);
+        if (illegal & rest)
+            flags |= LINE_ILLEGAL_BYTE;
+        if (masks.high & rest)
+            flags |= LINE_INVALID_UTF8;
+    }
+    return lineStart;
+}
+
+size_t scanLines(const char *data, size_t length, std::vector<LineSpan>& lines) {
+    static ScanLevel level = scanBestLevel();
+    return scanLinesWith(level, data, length, lines);
+}
@@ -0,0 +1,42 @@
+#ifndef SCANNER_HPP
+#define SCANNER_HPP
+
+#include <cstddef>
+#include <vector>
+
+// Splits received input into lines in one vectorized pass. Every 64-byte
+// block is first reduced to bitmasks of LF, CR, NUL and non-ASCII bytes
+// (AVX2 or SSE2, picked at runtime, with a scalar fallback); line spans
+// are then read off the LF bits. Only lines that contain non-ASCII bytes
+// are walked again, to validate their UTF-8.
+
+enum LineFlags {
+    LINE_ILLEGAL_BYTE = 1,      // NUL, or CR anywhere but right before LF
+    LINE_INVALID_UTF8 = 2
+};
+
+// One complete line: [start, start + length) is the content without the
+// line ending and surrounding spaces, end is the offset just past the LF.
+struct LineSpan {
+    size_t start;
+    size_t length;
+    size_t end;
+    unsigned int flags;
+};
+
+enum ScanLevel {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2
+};
+
+ScanLevel scanBestLevel();
+const char *scanLevelName(ScanLevel level);
+bool isValidUtf8(const unsigned char *data, size_t length);
+
+// Appends the complete lines in data to lines and returns the number of
+// bytes they cover; anything after the last LF is left for the next call.
+size_t scanLines(const char *data, size_t length, std::vector<LineSpan>& lines);
+size_t scanLinesWith(ScanLevel level, const char *data, size_t length, std::vector<LineSpan>& lines);
+
+#endif // SCANNER_HPP
@@ -0,0 +1,160 @@
+#include "Tls.hpp"
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <fcntl.h>
+#include <poll.h>
+
+#ifdef IRC_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+struct PendingHandshake {
+    SSL *ssl;
+    time_t started;
+};
+
+static SSL_CTX *tlsContext = NULL;
+static std::map<int, PendingHandshake> pendingHandshakes;
+
+static void setNonBlocking(int fd, bool enable) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return;
+    fcntl(fd, F_SETFL, enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+}
+
+bool tlsInit(const std::string& certFile, const std::string& keyFile) {
+    SSL_library_init();
+    SSL_load_error_strings();
+
+    tlsContext = SSL_CTX_new(TLS_server_method());
+    if (!tlsContext) {
+        std::cerr << "Error creating TLS context" << std::endl;
+        return false;
+    }
+
+    // OpenSSL 3.0 only offloads the receive side for TLS 1.2, and both
+    // directions must live in the kernel for the plain recv()/send() paths.
+    SSL_CTX_set_min_proto_version(tlsContext, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(tlsContext, TLS1_2_VERSION);
+    SSL_CTX_set_cipher_list(tlsContext, "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+                                        "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384");
+    SSL_CTX_set_options(tlsContext, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+
+    if (SSL_CTX_use_certificate_chain_file(tlsContext, certFile.c_str()) <= 0
+        || SSL_CTX_use_PrivateKey_file(tlsContext, keyFile.c_str(), SSL_FILETYPE_PEM) <= 0
+        || !SSL_CTX_check_private_key(tlsContext)) {
+        std::cerr << "Error loading TLS certificate or key" << std::endl;
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(tlsContext);
+        tlsContext = NULL;
+        return false;
+    }
+    return true;
+}
+
+bool tlsStart(int clientSock) {
+    if (!tlsContext)
+        return false;
+
+    SSL *ssl = SSL_new(tlsContext);
+    if (!ssl || !SSL_set_fd(ssl, clientSock)) {
+        SSL_free(ssl);
+        return false;
+    }
+    SSL_set_accept_state(ssl);
+    setNonBlocking(clientSock, true);
+    PendingHandshake& pending = pendingHandshakes[clientSock];
+    pending.ssl = ssl;
+    pending.started = time(NULL);
+    return true;
+}
+
+bool tlsIsPending(int clientSock) {
+    return pendingHandshakes.find(clientSock) != pendingHandshakes.end();
+}
+
+// Drives the handshake forward. Returns 1 once the connection is offloaded
+// to kTLS, 0 if more I/O is needed (events is updated for poll()), -1 on error.
+int tlsContinue(int clientSock, short& events) {
+    std::map<int, PendingHandshake>::iterator it = pendingHandshakes.find(clientSock);
+    if (it == pendingHandshakes.end())
+        return -1;
+
+    SSL *ssl = it->second.ssl;
+    int ret = SSL_accept(ssl);
+    if (ret <= 0) {
+        int err = SSL_get_error(ssl, ret);
+        if (err == SSL_ERROR_WANT_READ) {
+            events = POLLIN;
+            return 0;
+        }
+        if (err == SSL_ERROR_WANT_WRITE) {
+            events = POLLOUT;
+            return 0;
+        }
+        ERR_clear_error();
+        tlsDrop(clientSock);
+        return -1;
+    }
+
+    if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) || !BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+        std::cerr << "kTLS offload unavailable for " << SSL_get_cipher_name(ssl)
+                  << " (is the tls kernel module loaded?)" << std::endl;
+        tlsDrop(clientSock);
+        return -1;
+    }
+
+    // The kernel now owns the record layer; the userspace session is no
+    // longer needed and the socket goes back to the regular blocking paths.
+    SSL_free(ssl);
+    pendingHandshakes.erase(it);
+    setNonBlocking(clientSock, false);
+    events = POLLIN;
+    return 1;
+}
+
+// Connections that never finish the handshake would otherwise hold their
+// socket forever
+bool tlsHandshakeExpired(int clientSock) {
+    std::map<int, PendingHandshake>::const_iterator it = pendingHandshakes.find(clientSock);
+    return it != pendingHandshakes.end() && time(NULL) - it->second.started >= TLS_HANDSHAKE_TIMEOUT;
+}
+
+void tlsDrop(int clientSock) {
+    std::map<int, PendingHandshake>::iterator it = pendingHandshakes.find(clientSock);
+    if (it != pendingHandshakes.end()) {
+        SSL_free(it->second.ssl);
+        pendingHandshakes.erase(it);
+    }
+}
+
+#else
+
+bool tlsInit(const std::string&, const std::string&) {
+    std::cerr << "TLS support not compiled in (rebuild with `make TLS=1`)" << std::endl;
+    return false;
+}
+
+bool tlsStart(int) {
+    return false;
+}
+
+bool tlsIsPending(int) {
+    return false;
+}
+
+int tlsContinue(int, short&) {
+    return -1;
+}
+
+bool tlsHandshakeExpired(int) {
+    return false;
+}
+
+void tlsDrop(int) {
+}
+
+#endif
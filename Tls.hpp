@@ -0,0 +1,20 @@
+#ifndef TLS_HPP
+#define TLS_HPP
+
+#include <string>
+
+// TLS listener support. The handshake runs in-process with OpenSSL, then the
+// record layer is handed to the kernel (kTLS) so the socket can be read and
+// written with plain recv()/send() like any other client.
+// Only compiled in with `make TLS=1`; otherwise tlsInit() always fails.
+
+#define TLS_HANDSHAKE_TIMEOUT 10    // seconds a handshake may stay unfinished
+
+bool tlsInit(const std::string& certFile, const std::string& keyFile);
+bool tlsStart(int clientSock);
+bool tlsIsPending(int clientSock);
+int tlsContinue(int clientSock, short& events);
+bool tlsHandshakeExpired(int clientSock);
+void tlsDrop(int clientSock);
+
+#endif // TLS_HPP
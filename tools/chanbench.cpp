@@ -0,0 +1,94 @@
+// Channel lookup cost and heap use of the old std::map<std::string, Channel>
+// against ChannelTable, with the same names and the same random lookups.
+// Each lookup also reads the channel's key, as the JOIN checks do.
+// Usage: chanbench [channels] [lookups]
+
+#include "../Channel.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <malloc.h>
+#include <string>
+#include <vector>
+
+static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t heapInUse() {
+    return mallinfo2().uordblks;
+}
+
+static std::vector<std::string> makeNames(size_t count) {
+    std::vector<std::string> names;
+    char name[32];
+    for (size_t i = 0; i < count; ++i) {
+        std::snprintf(name, sizeof(name), "#Channel-%06lu", static_cast<unsigned long>(i * 7919 % count));
+        names.push_back(name);
+    }
+    return names;
+}
+
+// Indexes into names, drawn before timing so both runs see the same order
+static std::vector<size_t> makeLookups(size_t count, size_t channelCount) {
+    std::vector<size_t> lookups;
+    unsigned long state = 12345;
+    for (size_t i = 0; i < count; ++i) {
+        state = state * 6364136223846793005UL + 1442695040888963407UL;
+        lookups.push_back((state >> 33) % channelCount);
+    }
+    return lookups;
+}
+
+int main(int argc, char *argv[]) {
+    size_t channelCount = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 100000;
+    size_t lookupCount = argc > 2 ? std::strtoul(argv[2], NULL, 10) : 2000000;
+    if (channelCount == 0) {
+        std::fprintf(stderr, "Usage: %s [channels] [lookups]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> names = makeNames(channelCount);
+    std::vector<size_t> lookups = makeLookups(lookupCount, channelCount);
+    size_t sink = 0;
+
+    double mapNs, tableNs;
+    size_t mapBytes, tableBytes;
+    {
+        size_t before = heapInUse();
+        std::map<std::string, Channel> *byName = new std::map<std::string, Channel>;
+        for (size_t i = 0; i < channelCount; ++i)
+            (*byName)[names[i]] = Channel(names[i]);
+        mapBytes = heapInUse() - before;
+
+        double start = now();
+        for (size_t i = 0; i < lookupCount; ++i) {
+            std::map<std::string, Channel>::const_iterator it = byName->find(names[lookups[i]]);
+            sink += it->second.key.size() + it->second.name.size();
+        }
+        mapNs = (now() - start) * 1e9 / lookupCount;
+        delete byName;
+    }
+    {
+        size_t before = heapInUse();
+        ChannelTable *table = new ChannelTable;
+        for (size_t i = 0; i < channelCount; ++i)
+            table->create(names[i]);
+        tableBytes = heapInUse() - before;
+
+        double start = now();
+        for (size_t i = 0; i < lookupCount; ++i) {
+            const Channel& channel = (*table)[table->find(names[lookups[i]])];
+            sink += channel.key.size() + channel.name.size();
+        }
+        tableNs = (now() - start) * 1e9 / lookupCount;
+        delete table;
+    }
+
+    std::printf("%zu channels, %zu random lookups (checksum %zu)\n", channelCount, lookupCount, sink);
+    std::printf("std::map      %7.1f ns/lookup  %6.1f MB heap\n", mapNs, mapBytes / 1e6);
+    std::printf("ChannelTable  %7.1f ns/lookup  %6.1f MB heap\n", tableNs, tableBytes / 1e6);
+    return 0;
+}
@@ -0,0 +1,27 @@
+// Prints a credential for the ircserv <password> argument or ircserv.opers.
+// Usage: mkpasswd <password> [iterations]
+
+#include "../Hash.hpp"
+#include <cstdlib>
+#include <iostream>
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <password> [iterations]" << std::endl;
+        return 1;
+    }
+
+    unsigned int iterations = argc == 3 ? std::strtoul(argv[2], NULL, 10) : PBKDF2_DEFAULT_ITERATIONS;
+    if (iterations == 0) {
+        std::cerr << argv[0] << ": iterations must be positive" << std::endl;
+        return 1;
+    }
+
+    std::string credential = makeCredential(argv[1], iterations);
+    if (credential.empty()) {
+        std::cerr << argv[0] << ": could not read a random salt" << std::endl;
+        return 1;
+    }
+    std::cout << credential << std::endl;
+    return 0;
+}
@@ -0,0 +1,100 @@
+#!/bin/bash
+# Restart check for persistent channels: an operator registers #keep with
+# +P, the server is restarted, and the first user to join the restored
+# (empty) channel must be able to change its modes. The registry lives in
+# a state directory apart from the working directory, so the check also
+# fails if the server loses track of where it keeps it.
+#
+# With --timing, N channels (default 100000) are registered instead and
+# the restore time the restarted server logs is printed.
+# Run from the repository root after `make tools`.
+# Usage: tools/persistcheck.sh [port]
+#        tools/persistcheck.sh --timing [channels] [port]
+
+TIMING=0
+if [ "$1" = "--timing" ]; then
+    TIMING=1
+    COUNT=${2:-100000}
+    PORT=${3:-16690}
+else
+    PORT=${1:-16690}
+fi
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'kill $SERVER 2>/dev/null; rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+mkdir state
+
+echo "check $("$ROOT/tools/mkpasswd" secret 1000)" > ircserv.opers
+
+# The listener does not set SO_REUSEADDR, so a restart moves to the next
+# port rather than wait for the old connections to leave TIME_WAIT
+start_server() {
+    PORT=$((PORT + ${1:-0}))
+    "$ROOT/ircserv" "$PORT" pw state > server.log 2>&1 &
+    SERVER=$!
+    sleep 0.5
+}
+
+stop_server() {
+    kill $SERVER; wait $SERVER 2>/dev/null
+}
+
+# Sends the lines on one connection and prints everything the server sent back
+session() {
+    exec 3<>"/dev/tcp/127.0.0.1/$PORT" || exit 1
+    printf '%s\r\n' "$@" >&3
+    sleep 0.5
+    timeout 0.5 cat <&3
+    exec 3<&-
+}
+
+# Registers COUNT channels from one operator connection, kicking itself
+# out of each so the per-client channel limit never applies
+fill() {
+    exec 3<>"/dev/tcp/127.0.0.1/$PORT" || exit 1
+    # Reads every reply until the PONG sent after the last line
+    grep -q -m1 "filled" <&3 &
+    local reader=$!
+    printf 'PASS pw\r\nNICK filler\r\nUSER filler h s :filler\r\nOPER check secret\r\n' >&3
+    sleep 0.5
+    for ((i = 0; i < COUNT; i++)); do
+        printf 'JOIN #p%d\r\nMODE #p%d +P\r\nKICK #p%d filler\r\n' $i $i $i
+    done >&3
+    printf 'PING :filled\r\n' >&3
+    wait $reader
+    exec 3<&-
+    sleep 1     # let the registry writer catch up
+}
+
+if [ $TIMING = 1 ]; then
+    start_server
+    fill
+    stop_server
+    start_server 1
+    # The line is logged once the restore is done, which may take a while
+    for ((i = 0; i < 300; i++)); do
+        grep "Persistent channels" server.log && break
+        sleep 0.1
+    done
+    exit 0
+fi
+
+start_server
+session "PASS pw" "NICK alice" "USER alice h s :alice" "OPER check secret" \
+        "JOIN #keep" "MODE #keep +P" > first.log
+if ! grep -q "MODE #keep +P" first.log; then
+    echo "FAIL: could not make #keep persistent"; cat first.log; exit 1
+fi
+stop_server
+if [ ! -s state/channels.journal ]; then
+    echo "FAIL: nothing was written to the state directory"; exit 1
+fi
+
+start_server 1
+# -i toggles invite-only, so it answers +i
+session "PASS pw" "NICK bob" "USER bob h s :bob" "JOIN #keep" "MODE #keep -i" > second.log
+if grep -q " 482 " second.log || ! grep -q "MODE #keep +i" second.log; then
+    echo "FAIL: first user in the restored #keep is not a channel operator"; cat second.log; exit 1
+fi
+echo "OK: #keep survived the restart and its first user holds ops"
@@ -0,0 +1,114 @@
+// Loopback ping-pong latency through a running ircserv: two clients bounce
+// a PRIVMSG back and forth and the round trips are reported as percentiles.
+// Run it once against a normal build and once against `make LOWLATENCY=1`,
+// with the same number of rounds so both warm up alike.
+// Usage: pingbench <port> <password> [rounds]
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+static double nowUs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+struct Connection {
+    int fd;
+    std::string pending;
+};
+
+static void sendLine(Connection& conn, const std::string& line) {
+    std::string data = line + "\r\n";
+    if (send(conn.fd, data.data(), data.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(data.size())) {
+        std::perror("send");
+        std::exit(1);
+    }
+}
+
+// Reads until a line containing needle arrives, dropping everything before it
+static void waitFor(Connection& conn, const std::string& needle) {
+    while (true) {
+        size_t lineEnd;
+        while ((lineEnd = conn.pending.find('\n')) != std::string::npos) {
+            bool found = conn.pending.find(needle) < lineEnd;
+            conn.pending.erase(0, lineEnd + 1);
+            if (found)
+                return;
+        }
+        char buffer[4096];
+        ssize_t got = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if (got <= 0) {
+            std::fprintf(stderr, "connection closed while waiting for \"%s\"\n", needle.c_str());
+            std::exit(1);
+        }
+        conn.pending.append(buffer, got);
+    }
+}
+
+static Connection connectClient(int port, const std::string& password, const std::string& nick) {
+    Connection conn;
+    conn.fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(conn.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        std::perror("connect");
+        std::exit(1);
+    }
+    int one = 1;
+    setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sendLine(conn, "PASS " + password);
+    sendLine(conn, "NICK " + nick);
+    sendLine(conn, "USER " + nick + " localhost localhost :pingbench");
+    waitFor(conn, "Welcome");
+    return conn;
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    return sorted[static_cast<size_t>(p * (sorted.size() - 1) + 0.5)];
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3 && argc != 4) {
+        std::fprintf(stderr, "Usage: %s <port> <password> [rounds]\n", argv[0]);
+        return 1;
+    }
+    int port = std::atoi(argv[1]);
+    size_t rounds = argc == 4 ? std::strtoul(argv[3], NULL, 10) : 10000;
+
+    Connection ping = connectClient(port, argv[2], "pingbench_a");
+    Connection pong = connectClient(port, argv[2], "pingbench_b");
+
+    std::vector<double> samples;
+    for (size_t i = 0; i < rounds + rounds / 10; ++i) {
+        double start = nowUs();
+        sendLine(ping, "PRIVMSG pingbench_b :ping");
+        waitFor(pong, ":ping");
+        sendLine(pong, "PRIVMSG pingbench_a :pong");
+        waitFor(ping, ":pong");
+        if (i >= rounds / 10)   // the first tenth warms up caches and the spin budget
+            samples.push_back(nowUs() - start);
+    }
+
+    std::sort(samples.begin(), samples.end());
+    std::printf("%zu round trips (2 messages each), microseconds\n", samples.size());
+    std::printf("p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", percentile(samples, 0.5),
+                percentile(samples, 0.9), percentile(samples, 0.99), percentile(samples, 0.999), samples.back());
+    close(ping.fd);
+    close(pong.fd);
+    return 0;
+}
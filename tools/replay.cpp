@@ -0,0 +1,385 @@
+// Replays an ircserv traffic capture against a fresh server and reports
+// throughput and latency. Latency comes from PING probes sent after every
+// Nth replayed line of a registered connection: the server handles a
+// connection's lines in order, so the PONG arrives once everything sent
+// before it has been processed.
+//
+// Usage: replay [--fast] [--probe-every N] [--baseline FILE] [--threshold PCT]
+//               [--save-baseline FILE] <capture.bin> <port> <password>
+// Exits with 2 when throughput drops or p99 latency grows by more than the
+// threshold (default 10%) against the baseline. At 1x the throughput only
+// follows the capture, so compare throughput with --fast runs.
+
+#include "../Capture.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#define PROBE_TOKEN "replay-"
+#define DRAIN_TIMEOUT_MS 5000
+#define MAX_CAPTURED_LINE (1 << 20)
+
+struct Event {
+    CaptureRecord type;
+    uint64_t time;          // nanoseconds since the capture started
+    uint32_t connection;
+    std::string line;
+};
+
+struct Connection {
+    int fd;
+    bool registering;       // the capture holds its registration
+    bool registered;
+    bool closing;           // half-closed, reading the last replies
+    std::string input;
+
+    Connection() : fd(-1), registering(false), registered(false), closing(false) {}
+};
+
+struct Results {
+    size_t connections;
+    size_t lines;
+    size_t disconnects;
+    double seconds;
+    std::vector<double> latencies;  // microseconds
+
+    Results() : connections(0), lines(0), disconnects(0), seconds(0) {}
+};
+
+static double nowUs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static bool getVarint(std::istream& in, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = in.get();
+        if (byte == EOF)
+            return false;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool loadCapture(const char *file, std::vector<Event>& events) {
+    std::ifstream in(file, std::ios::binary);
+    CaptureHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+        || std::memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 || header.version != CAPTURE_VERSION) {
+        std::fprintf(stderr, "%s: not a version %d capture\n", file, CAPTURE_VERSION);
+        return false;
+    }
+
+    uint64_t time = 0;
+    int type;
+    while ((type = in.get()) != EOF) {
+        Event event;
+        uint64_t delta, connection, length = 0;
+        bool complete = getVarint(in, delta) && getVarint(in, connection);
+        if (complete && type == CAPTURE_LINE) {
+            complete = getVarint(in, length) && length <= MAX_CAPTURED_LINE;
+            event.line.resize(length);
+            complete = complete && (!length || in.read(&event.line[0], length));
+        }
+        if (!complete) {
+            std::fprintf(stderr, "%s: truncated record, replaying what came before it\n", file);
+            break;
+        }
+        time += delta;
+        event.type = static_cast<CaptureRecord>(type);
+        event.time = time;
+        event.connection = static_cast<uint32_t>(connection);
+        events.push_back(event);
+    }
+    return true;
+}
+
+static int connectTo(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+class Replayer {
+public:
+    Replayer(int port, const std::string& password, size_t probeEvery)
+        : _port(port), _password(password), _probeEvery(probeEvery), _sinceProbe(0), _nextProbe(0) {}
+
+    void handle(const Event& event, Results& results) {
+        Connection& conn = _connections[event.connection];
+        if (event.type == CAPTURE_CONNECT) {
+            conn = Connection();
+            conn.fd = connectTo(_port);
+            if (conn.fd < 0)
+                std::fprintf(stderr, "connection %u: connect failed\n", event.connection);
+            results.connections++;
+        } else if (event.type == CAPTURE_LINE && conn.fd >= 0 && !conn.closing) {
+            std::string command = commandOf(event.line);
+            send(conn, command == "PASS" ? "PASS " + _password : event.line);
+            results.lines++;
+            if (!conn.registered && (command == "NICK" || command == "USER"))
+                conn.registering = true;
+            if (conn.registered && command != "QUIT" && ++_sinceProbe >= _probeEvery) {
+                std::ostringstream probe;
+                probe << "PING :" << PROBE_TOKEN << _nextProbe;
+                _probes[_nextProbe++] = nowUs();
+                send(conn, probe.str());
+                _sinceProbe = 0;
+            }
+        } else if (event.type == CAPTURE_CLOSE && conn.fd >= 0) {
+            shutdown(conn.fd, SHUT_WR);
+            conn.closing = true;
+        }
+    }
+
+    // Reads whatever the server sent, waiting at most timeoutMs for it
+    void pump(int timeoutMs, Results& results) {
+        std::vector<pollfd> fds;
+        std::vector<Connection*> owners;
+        for (std::map<uint32_t, Connection>::iterator it = _connections.begin(); it != _connections.end(); ++it) {
+            if (it->second.fd < 0)
+                continue;
+            pollfd pfd;
+            pfd.fd = it->second.fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            fds.push_back(pfd);
+            owners.push_back(&it->second);
+        }
+        if (fds.empty() || poll(&fds[0], fds.size(), timeoutMs) <= 0)
+            return;
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (!fds[i].revents)
+                continue;
+            char buffer[65536];
+            ssize_t got = recv(fds[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (got <= 0) {
+                if (got < 0 && (errno == EAGAIN || errno == EINTR))
+                    continue;
+                close(owners[i]->fd);
+                owners[i]->fd = -1;
+                if (!owners[i]->closing)
+                    results.disconnects++;
+                continue;
+            }
+            owners[i]->input.append(buffer, got);
+            readLines(*owners[i], results);
+        }
+    }
+
+    bool probesOutstanding() const {
+        return !_probes.empty();
+    }
+
+    // Like a real client, do not send past registration before 001 arrived;
+    // without the capture's pauses the whole session would otherwise be
+    // sent while the password is still being checked
+    void awaitWelcome(const Event& event, Results& results) {
+        Connection& conn = _connections[event.connection];
+        if (event.type != CAPTURE_LINE || conn.fd < 0 || !conn.registering || conn.registered)
+            return;
+        std::string command = commandOf(event.line);
+        if (command == "PASS" || command == "NICK" || command == "USER" || command == "CAP")
+            return;
+        double deadline = nowUs() + DRAIN_TIMEOUT_MS * 1000.0;
+        while (conn.fd >= 0 && !conn.registered && nowUs() < deadline)
+            pump(10, results);
+    }
+
+private:
+    static std::string commandOf(const std::string& line) {
+        std::string command = line.substr(0, line.find(' '));
+        for (size_t i = 0; i < command.length(); ++i)
+            command[i] = std::toupper(static_cast<unsigned char>(command[i]));
+        return command;
+    }
+
+    void send(Connection& conn, const std::string& line) {
+        std::string data = line + "\r\n";
+        if (::send(conn.fd, data.data(), data.size(), MSG_NOSIGNAL) < 0) {
+            close(conn.fd);
+            conn.fd = -1;
+        }
+    }
+
+    void readLines(Connection& conn, Results& results) {
+        size_t lineEnd;
+        while ((lineEnd = conn.input.find('\n')) != std::string::npos) {
+            std::string line = conn.input.substr(0, lineEnd);
+            conn.input.erase(0, lineEnd + 1);
+            if (line.find(" 001 ") != std::string::npos)
+                conn.registered = true;
+            size_t token = line.find(" PONG ");
+            if (token != std::string::npos && (token = line.find(":" PROBE_TOKEN, token)) != std::string::npos) {
+                unsigned long id = std::strtoul(line.c_str() + token + std::strlen(":" PROBE_TOKEN), NULL, 10);
+                std::map<unsigned long, double>::iterator probe = _probes.find(id);
+                if (probe != _probes.end()) {
+                    results.latencies.push_back(nowUs() - probe->second);
+                    _probes.erase(probe);
+                }
+            }
+        }
+    }
+
+    int _port;
+    std::string _password;
+    size_t _probeEvery;
+    size_t _sinceProbe;
+    unsigned long _nextProbe;
+    std::map<uint32_t, Connection> _connections;
+    std::map<unsigned long, double> _probes;
+};
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    return sorted.empty() ? 0 : sorted[static_cast<size_t>(p * (sorted.size() - 1) + 0.5)];
+}
+
+static bool readBaseline(const char *file, std::map<std::string, double>& values) {
+    std::ifstream in(file);
+    std::string key;
+    double value;
+    while (in >> key >> value)
+        values[key] = value;
+    return !values.empty();
+}
+
+int main(int argc, char *argv[]) {
+    bool fast = false;
+    size_t probeEvery = 8;
+    double threshold = 10;
+    const char *baselineFile = NULL;
+    const char *saveFile = NULL;
+    std::vector<const char*> positional;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--fast")
+            fast = true;
+        else if (arg == "--probe-every" && i + 1 < argc)
+            probeEvery = std::max(1UL, std::strtoul(argv[++i], NULL, 10));
+        else if (arg == "--threshold" && i + 1 < argc)
+            threshold = std::atof(argv[++i]);
+        else if (arg == "--baseline" && i + 1 < argc)
+            baselineFile = argv[++i];
+        else if (arg == "--save-baseline" && i + 1 < argc)
+            saveFile = argv[++i];
+        else
+            positional.push_back(argv[i]);
+    }
+    if (positional.size() != 3) {
+        std::fprintf(stderr, "Usage: %s [--fast] [--probe-every N] [--baseline FILE] [--threshold PCT]\n"
+                             "       [--save-baseline FILE] <capture.bin> <port> <password>\n", argv[0]);
+        return 1;
+    }
+
+    std::map<std::string, double> baseline;
+    if (baselineFile) {
+        if (!readBaseline(baselineFile, baseline)) {
+            std::fprintf(stderr, "%s: no baseline values\n", baselineFile);
+            return 1;
+        }
+        if ((baseline["fast"] != 0) != fast) {
+            std::fprintf(stderr, "%s was recorded %s, rerun %s\n", baselineFile,
+                         fast ? "at 1x" : "with --fast", fast ? "without --fast" : "with --fast");
+            return 1;
+        }
+    }
+
+    std::vector<Event> events;
+    if (!loadCapture(positional[0], events))
+        return 1;
+
+    Replayer replayer(std::atoi(positional[1]), positional[2], probeEvery);
+    Results results;
+    double start = nowUs();
+    for (size_t i = 0; i < events.size(); ++i) {
+        if (!fast) {
+            double due = start + events[i].time / 1e3;
+            double now;
+            while ((now = nowUs()) < due)
+                replayer.pump(static_cast<int>((due - now) / 1000), results);
+        } else {
+            replayer.pump(0, results);
+            replayer.awaitWelcome(events[i], results);
+        }
+        replayer.handle(events[i], results);
+    }
+
+    double drainStart = nowUs();
+    while (replayer.probesOutstanding() && nowUs() - drainStart < DRAIN_TIMEOUT_MS * 1000.0)
+        replayer.pump(10, results);
+    results.seconds = (nowUs() - start) / 1e6;
+
+    std::sort(results.latencies.begin(), results.latencies.end());
+    std::map<std::string, double> measured;
+    measured["fast"] = fast;
+    measured["probes"] = results.latencies.size();
+    measured["throughput"] = results.lines / results.seconds;
+    measured["p50"] = percentile(results.latencies, 0.5);
+    measured["p90"] = percentile(results.latencies, 0.9);
+    measured["p99"] = percentile(results.latencies, 0.99);
+
+    std::printf("%zu connections, %zu lines in %.3f s (%s), %zu unexpected disconnects\n", results.connections,
+                results.lines, results.seconds, fast ? "as fast as possible" : "1x", results.disconnects);
+    std::printf("throughput %.0f lines/s\n", measured["throughput"]);
+    std::printf("latency over %zu probes, microseconds: p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+                results.latencies.size(), measured["p50"], measured["p90"], measured["p99"],
+                results.latencies.empty() ? 0 : results.latencies.back());
+    if (replayer.probesOutstanding())
+        std::printf("warning: some probes were never answered\n");
+
+    if (saveFile) {
+        std::ofstream out(saveFile);
+        for (std::map<std::string, double>::iterator it = measured.begin(); it != measured.end(); ++it)
+            out << it->first << " " << it->second << "\n";
+    }
+
+    int status = 0;
+    if (baselineFile) {
+        double minThroughput = baseline["throughput"] * (1 - threshold / 100);
+        double maxP99 = baseline["p99"] * (1 + threshold / 100);
+        if (measured["throughput"] < minThroughput) {
+            std::printf("REGRESSION: throughput %.0f lines/s is below %.0f (baseline %.0f - %.0f%%)\n",
+                        measured["throughput"], minThroughput, baseline["throughput"], threshold);
+            status = 2;
+        }
+        if (baseline["probes"] > 0 && measured["p99"] > maxP99) {
+            std::printf("REGRESSION: p99 latency %.1f us is above %.1f (baseline %.1f + %.0f%%)\n",
+                        measured["p99"], maxP99, baseline["p99"], threshold);
+            status = 2;
+        }
+        if (status == 0)
+            std::printf("within %.0f%% of baseline %s\n", threshold, baselineFile);
+    }
+    return status;
+}
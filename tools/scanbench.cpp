@@ -0,0 +1,88 @@
+// Compares receive-path line splitting throughput: the old find/substr/trim
+// loop against the scanner at every level this CPU supports.
+// Usage: scanbench [megabytes] [chunk bytes]
+
+#include "../Scanner.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+
+static std::string trim(const std::string &str) {
+    size_t first = str.find_first_not_of(" \r\n");
+    size_t last = str.find_last_not_of(" \r\n");
+    return (first == std::string::npos || last == std::string::npos) ? "" : str.substr(first, last - first + 1);
+}
+
+static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// IRC-like traffic: mostly ASCII PRIVMSGs of varying length, some UTF-8
+static std::string makeInput(size_t bytes) {
+    static const char *texts[] = {
+        "hi", "anyone around?", "the build is green again after the last fix, merging now",
+        "caf\xc3\xa9 at 5? \xe2\x82\xac" "3 each", "\xf0\x9f\x98\x80\xf0\x9f\x98\x80",
+        "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore"
+    };
+    std::string input;
+    srand(42);
+    while (input.size() < bytes) {
+        input += "PRIVMSG #channel";
+        input += static_cast<char>('a' + rand() % 26);
+        input += " :";
+        input += texts[rand() % (sizeof(texts) / sizeof(texts[0]))];
+        input += "\r\n";
+    }
+    return input;
+}
+
+static void report(const char *name, size_t bytes, size_t lines, double seconds) {
+    std::printf("%-10s %8.3f GB/s  %10zu lines\n", name, bytes / seconds / 1e9, lines);
+}
+
+int main(int argc, char *argv[]) {
+    size_t megabytes = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 64;
+    size_t chunk = argc > 2 ? std::strtoul(argv[2], NULL, 10) : 1024;
+    std::string input = makeInput(megabytes * 1024 * 1024);
+    std::printf("%zu bytes in %zu byte chunks, best level %s\n", input.size(), chunk, scanLevelName(scanBestLevel()));
+
+    size_t lines = 0, checksum = 0;
+    std::string buffer;
+    double start = now();
+    for (size_t off = 0; off < input.size(); off += chunk) {
+        buffer.append(input, off, chunk);
+        size_t pos;
+        while ((pos = buffer.find('\n')) != std::string::npos) {
+            std::string message = buffer.substr(0, pos);
+            message = trim(message);
+            buffer.erase(0, pos + 1);
+            checksum += message.size();
+            lines++;
+        }
+    }
+    report("baseline", input.size(), lines, now() - start);
+
+    for (int level = SCAN_SCALAR; level <= scanBestLevel(); ++level) {
+        std::vector<LineSpan> spans;
+        lines = 0;
+        buffer.clear();
+        start = now();
+        for (size_t off = 0; off < input.size(); off += chunk) {
+            buffer.append(input, off, chunk);
+            spans.clear();
+            size_t used = scanLinesWith(static_cast<ScanLevel>(level), buffer.data(), buffer.size(), spans);
+            for (size_t i = 0; i < spans.size(); ++i) {
+                std::string message = buffer.substr(spans[i].start, spans[i].length);
+                checksum += message.size() + spans[i].flags;
+            }
+            buffer.erase(0, used);
+            lines += spans.size();
+        }
+        report(scanLevelName(static_cast<ScanLevel>(level)), input.size(), lines, now() - start);
+    }
+    return checksum == 0;
+}
@@ -0,0 +1,275 @@
+// CPU cost per message of the ways a client can reach ircserv: plaintext,
+// TLS in userspace (what a TLS proxy in front of the server pays) and
+// kTLS, where the handshake runs in OpenSSL and the records are then read
+// and written with plain recv()/send() as in Tls.cpp. A forked client
+// sends IRC-sized lines in batches, the server side echoes every line with
+// its own write like sendMessage() does, and only the server process's CPU
+// time is counted. kTLS needs the tls kernel module; without it that mode
+// is reported as unavailable. Built with `make TLS=1 tools`.
+// Usage: tlsbench [messages]
+
+#include <arpa/inet.h>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BATCH_LINES 32
+#define LINE ":benchnick!bench@localhost PRIVMSG #tlsbench :the quick brown fox jumps over the lazy dog\r\n"
+
+enum Mode { PLAINTEXT, USERSPACE_TLS, KERNEL_TLS };
+
+// ssl is NULL whenever the socket is read and written directly
+struct Endpoint {
+    int fd;
+    SSL *ssl;
+};
+
+struct Result {
+    double cpuUs;
+    double userUs;
+    double systemUs;
+    double wallSeconds;
+};
+
+static double nowSeconds() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double processCpuUs() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double cpuUs(const timeval& tv) {
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+// Every line is its own write, so Nagle would hold most of them back
+static void setNoDelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static ssize_t readSome(Endpoint& conn, char *buffer, size_t length) {
+    if (conn.ssl)
+        return SSL_read(conn.ssl, buffer, static_cast<int>(length));
+    return recv(conn.fd, buffer, length, 0);
+}
+
+static bool writeAll(Endpoint& conn, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = conn.ssl ? SSL_write(conn.ssl, data, static_cast<int>(length))
+                                   : send(conn.fd, data, length, MSG_NOSIGNAL);
+        if (written <= 0)
+            return false;
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+// Self-signed P-256 certificate, so the bench needs no files
+static SSL_CTX *createServerContext() {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!key || !cert || !ctx)
+        return NULL;
+
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_sign(cert, key, EVP_sha256());
+
+    // Same protocol and ciphers as the ircserv TLS listener
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_cipher_list(ctx, "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384");
+    if (SSL_CTX_use_certificate(ctx, cert) <= 0 || SSL_CTX_use_PrivateKey(ctx, key) <= 0)
+        return NULL;
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ctx;
+}
+
+static int createListener(int& port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, 1) < 0
+        || getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &length) < 0) {
+        std::perror("listener");
+        std::exit(1);
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static void runClient(int port, Mode mode, size_t messages) {
+    Endpoint conn = { socket(AF_INET, SOCK_STREAM, 0), NULL };
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(conn.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+        _exit(1);
+    setNoDelay(conn.fd);
+
+    if (mode != PLAINTEXT) {
+        SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+        conn.ssl = SSL_new(ctx);
+        SSL_set_fd(conn.ssl, conn.fd);
+        if (SSL_connect(conn.ssl) != 1)
+            _exit(1);
+    }
+
+    const size_t lineLength = std::strlen(LINE);
+    std::string batch;
+    for (int i = 0; i < BATCH_LINES; ++i)
+        batch += LINE;
+
+    char buffer[65536];
+    for (size_t sent = 0; sent < messages;) {
+        size_t count = messages - sent < BATCH_LINES ? messages - sent : BATCH_LINES;
+        if (!writeAll(conn, batch.data(), count * lineLength))
+            _exit(1);
+        for (size_t expected = count * lineLength; expected > 0;) {
+            ssize_t got = readSome(conn, buffer, expected < sizeof(buffer) ? expected : sizeof(buffer));
+            if (got <= 0)
+                _exit(1);
+            expected -= got;
+        }
+        sent += count;
+    }
+    _exit(0);
+}
+
+// Returns an empty string on success, otherwise why the mode could not run
+static std::string runServer(int listener, Mode mode, size_t messages, SSL_CTX *ctx, Result& result) {
+    Endpoint conn = { accept(listener, NULL, NULL), NULL };
+    if (conn.fd < 0)
+        return "accept failed";
+    setNoDelay(conn.fd);
+
+    if (mode != PLAINTEXT) {
+        SSL *ssl = SSL_new(ctx);
+        if (mode == KERNEL_TLS)
+            SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+        SSL_set_fd(ssl, conn.fd);
+        if (SSL_accept(ssl) != 1) {
+            ERR_print_errors_fp(stderr);
+            return "handshake failed";
+        }
+        if (mode == USERSPACE_TLS) {
+            conn.ssl = ssl;
+        } else {
+            bool offloaded = BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+            SSL_free(ssl);
+            if (!offloaded) {
+                close(conn.fd);
+                return "unavailable (is the tls kernel module loaded?)";
+            }
+        }
+    }
+
+    rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    double start = nowSeconds();
+    double cpuStart = processCpuUs();
+
+    char buffer[65536];
+    std::string pending;
+    for (size_t echoed = 0; echoed < messages;) {
+        ssize_t got = readSome(conn, buffer, sizeof(buffer));
+        if (got <= 0)
+            return "connection closed early";
+        pending.append(buffer, got);
+
+        size_t lineStart = 0, lineEnd;
+        while ((lineEnd = pending.find('\n', lineStart)) != std::string::npos) {
+            if (!writeAll(conn, pending.data() + lineStart, lineEnd + 1 - lineStart))
+                return "write failed";
+            lineStart = lineEnd + 1;
+            ++echoed;
+        }
+        pending.erase(0, lineStart);
+    }
+
+    result.cpuUs = processCpuUs() - cpuStart;
+    result.wallSeconds = nowSeconds() - start;
+    getrusage(RUSAGE_SELF, &after);
+    result.userUs = cpuUs(after.ru_utime) - cpuUs(before.ru_utime);
+    result.systemUs = cpuUs(after.ru_stime) - cpuUs(before.ru_stime);
+    if (conn.ssl)
+        SSL_free(conn.ssl);
+    close(conn.fd);
+    return "";
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        std::fprintf(stderr, "Usage: %s [messages]\n", argv[0]);
+        return 1;
+    }
+    size_t messages = argc == 2 ? std::strtoul(argv[1], NULL, 10) : 200000;
+    std::signal(SIGPIPE, SIG_IGN);
+
+    SSL_CTX *ctx = createServerContext();
+    if (!ctx) {
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+
+    const char *names[] = { "plaintext", "userspace TLS", "kTLS" };
+    std::printf("%zu messages of %zu bytes, echoed with one write per line\n", messages, std::strlen(LINE));
+    for (int mode = PLAINTEXT; mode <= KERNEL_TLS; ++mode) {
+        int port;
+        int listener = createListener(port);
+        pid_t child = fork();
+        if (child == 0) {
+            close(listener);
+            runClient(port, static_cast<Mode>(mode), messages);
+        }
+
+        Result result;
+        std::string error = runServer(listener, static_cast<Mode>(mode), messages, ctx, result);
+        close(listener);
+        if (!error.empty())
+            kill(child, SIGTERM);
+        waitpid(child, NULL, 0);
+
+        if (!error.empty()) {
+            std::printf("%-14s %s\n", names[mode], error.c_str());
+            continue;
+        }
+        std::printf("%-14s %.2f us CPU/message (user %.2f, sys %.2f), %.0f messages/s\n", names[mode],
+                    result.cpuUs / messages, result.userUs / messages,
+                    result.systemUs / messages, messages / result.wallSeconds);
+    }
+    SSL_CTX_free(ctx);
+    return 0;
+}
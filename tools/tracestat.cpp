@@ -0,0 +1,95 @@
+// Turns an ircserv flight recorder dump into per-command latency breakdowns.
+// Usage: tracestat <ircserv-trace-*.bin>
+
+#include "../Recorder.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+struct Stage {
+    const char *name;
+    TracePoint from;
+    TracePoint to;
+};
+
+static const Stage stages[] = {
+    { "parse", TRACE_RECV, TRACE_PARSE },
+    { "dispatch", TRACE_PARSE, TRACE_DISPATCH },
+    { "fanout", TRACE_FANOUT_START, TRACE_FANOUT_END },
+    { "total", TRACE_RECV, TRACE_FLUSH },
+};
+static const size_t stageCount = sizeof(stages) / sizeof(stages[0]);
+
+struct CommandStats {
+    std::vector<double> samples[stageCount];   // microseconds
+    unsigned long count;
+    unsigned long queued;
+    unsigned long fanout;
+
+    CommandStats() : count(0), queued(0), fanout(0) {}
+};
+
+static double percentile(std::vector<double>& values, double p) {
+    if (values.empty())
+        return 0;
+    size_t index = static_cast<size_t>(p * (values.size() - 1) + 0.5);
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <trace.bin>" << std::endl;
+        return 1;
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    TraceHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+        || std::memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TRACE_VERSION || header.eventSize != sizeof(TraceEvent)) {
+        std::cerr << argv[1] << ": not a version " << TRACE_VERSION << " trace dump" << std::endl;
+        return 1;
+    }
+
+    std::map<std::string, CommandStats> commands;
+    TraceEvent event;
+    for (uint64_t i = 0; i < header.eventCount && in.read(reinterpret_cast<char*>(&event), sizeof(event)); ++i) {
+        event.command[sizeof(event.command) - 1] = '\0';
+        CommandStats& stats = commands[event.command[0] ? event.command : "(empty)"];
+        stats.count++;
+        stats.fanout += event.fanout;
+        if (event.flags & TRACE_FLAG_QUEUED)
+            stats.queued++;
+        for (size_t s = 0; s < stageCount; ++s) {
+            uint64_t from = event.timestamps[stages[s].from];
+            uint64_t to = event.timestamps[stages[s].to];
+            if (from && to >= from)
+                stats.samples[s].push_back((to - from) / 1000.0);
+        }
+    }
+
+    std::printf("latencies in microseconds, p50/p99/max\n");
+    std::printf("%-12s %8s %8s %7s", "command", "count", "fanout", "queued");
+    for (size_t s = 0; s < stageCount; ++s)
+        std::printf("  %26s", stages[s].name);
+    std::printf("\n");
+
+    for (std::map<std::string, CommandStats>::iterator it = commands.begin(); it != commands.end(); ++it) {
+        CommandStats& stats = it->second;
+        std::printf("%-12s %8lu %8.1f %7lu", it->first.c_str(), stats.count,
+                    static_cast<double>(stats.fanout) / stats.count, stats.queued);
+        for (size_t s = 0; s < stageCount; ++s) {
+            std::vector<double>& values = stats.samples[s];
+            double maxValue = values.empty() ? 0 : *std::max_element(values.begin(), values.end());
+            std::printf("  %8.1f/%8.1f/%8.1f", percentile(values, 0.5), percentile(values, 0.99), maxValue);
+        }
+        std::printf("\n");
+    }
+    return 0;
+}